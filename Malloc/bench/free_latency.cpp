@@ -0,0 +1,45 @@
+// Free latency benchmark for malloc_3: fragments the heap with a growing
+// number of free blocks that cannot coalesce, then times alloc/free rounds
+// that overflow the thread cache, so every round pushes blocks back onto
+// the fragmented free list.
+//
+// To run:
+//  ./bench/free_latency [rounds]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include "../malloc_3.h"
+
+static const size_t BLOCK_SIZE = 200; //one order-1 block
+static const int ROUND_BLOCKS = 256;
+
+int main(int argc, char** argv) {
+    int rounds = argc > 1 ? atoi(argv[1]) : 2000;
+    const int holes_levels[] = {0, 500, 1000, 2000, 4000, 6000};
+    printf("%10s %12s\n", "free holes", "ns/free");
+    for (int holes : holes_levels) {
+        //allocate pairs and free every other block, so no freed block has a free buddy
+        std::vector<void*> pinned;
+        std::vector<void*> punched;
+        for (int i = 0; i < 2 * holes; ++i) {
+            void* p = smalloc(BLOCK_SIZE);
+            if (!p) break;
+            (i % 2 ? pinned : punched).push_back(p);
+        }
+        for (void* p : punched) sfree(p);
+
+        void* round[ROUND_BLOCKS];
+        double free_ns = 0;
+        for (int r = 0; r < rounds; ++r) {
+            for (int i = 0; i < ROUND_BLOCKS; ++i) round[i] = smalloc(BLOCK_SIZE);
+            auto start = std::chrono::steady_clock::now();
+            for (int i = 0; i < ROUND_BLOCKS; ++i) sfree(round[i]);
+            free_ns += std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        }
+        printf("%10d %12.1f\n", holes, free_ns / ((double)rounds * ROUND_BLOCKS));
+        for (void* p : pinned) sfree(p);
+    }
+    return 0;
+}
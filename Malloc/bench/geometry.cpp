@@ -0,0 +1,107 @@
+// Geometry benchmark for malloc_3: runs the same churn workloads against the
+// BuddyAllocator of each preset geometry. A workload keeps a fixed number of
+// live blocks and replaces a random one per operation. Reports throughput
+// and footprint, the arena and mapping bytes held at the end of the run, as a
+// multiple of the bytes asked for by the live blocks. Each run is in its own
+// child process, so earlier runs leave no arenas behind.
+//
+// To run:
+//  ./bench/geometry [scale]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+#include "../malloc_3.h"
+
+struct Workload {
+    const char* name;
+    size_t slots; //live blocks
+    long ops;
+    size_t (*size)(unsigned r1, unsigned r2);
+};
+
+//16 to 256 bytes, uniform
+static size_t smallSize(unsigned r1, unsigned) {
+    return 16 + r1 % 241;
+}
+
+//16 bytes to 512 KB, uniform in the power of two
+static size_t mixedSize(unsigned r1, unsigned r2) {
+    size_t base = (size_t)16 << (r1 % 15);
+    return base + r2 % base;
+}
+
+//32 KB to 1 MB, uniform
+static size_t largeSize(unsigned r1, unsigned) {
+    return 32 * 1024 + r1 % (1024 * 1024 - 32 * 1024);
+}
+
+static unsigned nextRandom(unsigned* seed) {
+    *seed = *seed * 1103515245 + 12345;
+    return *seed >> 8;
+}
+
+template <typename Geometry>
+static void run(const char* preset, const Workload& w, double scale) {
+    typedef BuddyAllocator<Geometry> Alloc;
+    std::vector<void*> ptrs(w.slots);
+    std::vector<size_t> sizes(w.slots);
+    unsigned seed = 7;
+    size_t live = 0;
+    for (size_t i = 0; i < w.slots; ++i) {
+        sizes[i] = w.size(nextRandom(&seed), nextRandom(&seed));
+        ptrs[i] = Alloc::smalloc(sizes[i]);
+        if (ptrs[i]) *(char*)ptrs[i] = 1;
+        live += sizes[i];
+    }
+
+    long ops = (long)(w.ops * scale);
+    auto start = std::chrono::steady_clock::now();
+    for (long i = 0; i < ops; ++i) {
+        size_t slot = nextRandom(&seed) % w.slots;
+        Alloc::sfree(ptrs[slot]);
+        live -= sizes[slot];
+        sizes[slot] = w.size(nextRandom(&seed), nextRandom(&seed));
+        ptrs[slot] = Alloc::smalloc(sizes[slot]);
+        if (ptrs[slot]) *(char*)ptrs[slot] = 1;
+        live += sizes[slot];
+    }
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    HeapStats stats;
+    Alloc::heap_stats(&stats);
+    size_t footprint = stats.arena_bytes + stats.mmap_bytes + stats.large_cache_bytes;
+    printf("%-8s %-8s %12.2f %10.1f %14.1f %10.2f\n", w.name, preset, ops / secs / 1e6,
+           live / 1048576.0, footprint / 1048576.0, (double)footprint / live);
+}
+
+template <typename Geometry>
+static void runInChild(const char* preset, const Workload& w, double scale) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        run<Geometry>(preset, w, scale);
+        fflush(stdout);
+        _exit(0);
+    }
+    waitpid(pid, NULL, 0);
+}
+
+int main(int argc, char** argv) {
+    double scale = argc > 1 ? atof(argv[1]) : 1.0;
+    const Workload workloads[] = {
+        {"small", 500000, 5000000, smallSize},
+        {"mixed", 2048, 500000, mixedSize},
+        {"large", 128, 100000, largeSize},
+    };
+    printf("%-8s %-8s %12s %10s %14s %10s\n", "workload", "preset", "Mops/sec", "live MB", "footprint MB", "overhead");
+    for (const Workload& w : workloads) {
+        runInChild<SmallObjectGeometry>("small", w, scale);
+        runInChild<BalancedGeometry>("balanced", w, scale);
+        runInChild<LargeBufferGeometry>("large", w, scale);
+    }
+    return 0;
+}
@@ -0,0 +1,80 @@
+// Transparent huge page benchmark for malloc_3: fills a large working set of
+// buddy blocks and one large mapping, then times random 8-byte accesses that
+// miss the dTLB on 4 KB pages. Each mode runs in its own child process, so
+// the arenas of the first run do not leak into the second.
+//
+// To run:
+//  ./bench/hugepages [working set MB] [accesses in millions]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+#include "../malloc_3.h"
+
+static const size_t BLOCK_SIZE = 60 * 1024; //order-9 buddy blocks
+static const size_t LARGE_SIZE = 64 * 1024 * 1024;
+static volatile unsigned long g_sink;
+
+static size_t anonHugePagesKb() {
+    FILE* f = fopen("/proc/self/smaps_rollup", "r");
+    if (!f) return 0;
+    char line[256];
+    size_t kb = 0;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "AnonHugePages: %zu kB", &kb) == 1) break;
+    }
+    fclose(f);
+    return kb;
+}
+
+static void run(bool huge, size_t working_set, long accesses) {
+    if (huge) shugepages(true, 2 * 1024 * 1024);
+    std::vector<char*> blocks;
+    for (size_t total = 0; total < working_set; total += BLOCK_SIZE) {
+        char* p = (char*)smalloc(BLOCK_SIZE);
+        if (!p) break;
+        memset(p, 1, BLOCK_SIZE);
+        blocks.push_back(p);
+    }
+    char* large = (char*)smalloc(LARGE_SIZE);
+    memset(large, 1, LARGE_SIZE);
+
+    unsigned seed = 12345;
+    unsigned long sum = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (long i = 0; i < accesses; ++i) {
+        seed = seed * 1103515245 + 12345;
+        size_t r = seed >> 4;
+        if (i & 3) {
+            char* block = blocks[r % blocks.size()];
+            sum += ++block[(r >> 6) % (BLOCK_SIZE / 8) * 8];
+        } else {
+            sum += ++large[(r * 8) % LARGE_SIZE];
+        }
+    }
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    g_sink = sum;
+    printf("%-4s %12.2f %14.1f %16zu %16zu\n", huge ? "on" : "off", accesses / secs / 1e6,
+           secs * 1e9 / accesses, _num_hugepage_bytes() >> 20, anonHugePagesKb() >> 10);
+}
+
+int main(int argc, char** argv) {
+    size_t working_set = (argc > 1 ? atol(argv[1]) : 512) * 1024 * 1024;
+    long accesses = (argc > 2 ? atol(argv[2]) : 50) * 1000000;
+    printf("%-4s %12s %14s %16s %16s\n", "thp", "Macc/sec", "ns/access", "advised MB", "AnonHuge MB");
+    fflush(stdout);
+    for (int huge = 0; huge <= 1; ++huge) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            run(huge, working_set, accesses);
+            fflush(stdout);
+            _exit(0);
+        }
+        waitpid(pid, NULL, 0);
+    }
+    return 0;
+}
@@ -0,0 +1,86 @@
+// Producer/consumer benchmark for malloc_3's remote free queues: in each
+// pair, one thread allocates buffers and hands them over a ring to another
+// thread that frees them, with remote frees off and on. The two threads of a
+// pair are pinned to different CPUs, so every free is a cross-CPU one.
+//
+// To run:
+//  ./bench/remote_free [buffers per pair]
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+#include <pthread.h>
+#include <sched.h>
+#include "../malloc_3.h"
+
+static const size_t RING_SIZE = 1024;
+static const size_t MAX_SIZE = 16384; //up to order 7, past the thread cache orders
+
+//single-producer single-consumer ring of buffers
+struct Ring {
+    void* slots[RING_SIZE];
+    std::atomic<size_t> head{0}; //next slot to read
+    std::atomic<size_t> tail{0}; //next slot to write
+};
+
+static void pinToCpu(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+static void producer(Ring* ring, long buffers, int cpu, unsigned seed) {
+    pinToCpu(cpu);
+    for (long i = 0; i < buffers; ++i) {
+        seed = seed * 1103515245 + 12345;
+        size_t size = 16 + (seed >> 8) % MAX_SIZE;
+        void* p = smalloc(size);
+        if (p) *(char*)p = 1;
+        size_t tail = ring->tail.load(std::memory_order_relaxed);
+        while (tail - ring->head.load(std::memory_order_acquire) == RING_SIZE) std::this_thread::yield();
+        ring->slots[tail % RING_SIZE] = p;
+        ring->tail.store(tail + 1, std::memory_order_release);
+    }
+}
+
+static void consumer(Ring* ring, long buffers, int cpu) {
+    pinToCpu(cpu);
+    for (long i = 0; i < buffers; ++i) {
+        size_t head = ring->head.load(std::memory_order_relaxed);
+        while (ring->tail.load(std::memory_order_acquire) == head) std::this_thread::yield();
+        sfree(ring->slots[head % RING_SIZE]);
+        ring->head.store(head + 1, std::memory_order_release);
+    }
+}
+
+static double run(int pairs, long buffers, int cpus) {
+    std::vector<Ring> rings(pairs);
+    std::vector<std::thread> pool;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < pairs; ++i) {
+        pool.emplace_back(producer, &rings[i], buffers, (2 * i) % cpus, (unsigned)(i + 1));
+        pool.emplace_back(consumer, &rings[i], buffers, (2 * i + 1) % cpus);
+    }
+    for (auto& th : pool) th.join();
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return (double)buffers * pairs / secs;
+}
+
+int main(int argc, char** argv) {
+    long buffers = argc > 1 ? atol(argv[1]) : 1000000;
+    int cpus = (int)std::thread::hardware_concurrency();
+    if (cpus < 2) printf("only one CPU: every free is local, both modes take the same path\n");
+    printf("%6s %16s %16s %8s\n", "pairs", "locked buf/sec", "remote buf/sec", "gain");
+    for (int pairs = 1; pairs <= 8; pairs *= 2) {
+        sremote_frees(false);
+        double locked = run(pairs, buffers, cpus);
+        sremote_frees(true);
+        double remote = run(pairs, buffers, cpus);
+        printf("%6d %16.0f %16.0f %7.2fx\n", pairs, locked, remote, remote / locked);
+    }
+    return 0;
+}
@@ -0,0 +1,100 @@
+// Sized free benchmark for malloc_3: fills a heap much larger than the last
+// level cache, then frees every block in random order, once with sfree and
+// once with sfree_sized. sfree reads the slab or block header of each block
+// to learn its size, sfree_sized does not. Reports ns and, where the kernel
+// lets us count them, last level cache misses per free.
+//
+// To run:
+//  ./bench/sized_free [blocks]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "../malloc_3.h"
+
+static const size_t EVICT_BYTES = 64 * 1024 * 1024;
+
+//cache miss counter of this thread, or -1 if perf events are not available
+static int openMissCounter() {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+//walks a buffer larger than the cache, so the heap starts out cold
+static void evictCaches(std::vector<char>& buffer) {
+    for (size_t i = 0; i < buffer.size(); i += 64) buffer[i]++;
+}
+
+struct Result {
+    double ns_per_free;
+    double misses_per_free; //negative when not counted
+};
+
+static Result run(size_t size, size_t blocks, bool sized, int counter, std::vector<char>& evict) {
+    std::vector<void*> ptrs(blocks);
+    for (size_t i = 0; i < blocks; ++i) {
+        ptrs[i] = smalloc(size);
+        if (ptrs[i]) *(char*)ptrs[i] = 1;
+    }
+    std::shuffle(ptrs.begin(), ptrs.end(), std::mt19937(7));
+    evictCaches(evict);
+
+    if (counter >= 0) {
+        ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+        ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    auto start = std::chrono::steady_clock::now();
+    if (sized) {
+        for (void* p : ptrs) sfree_sized(p, size);
+    } else {
+        for (void* p : ptrs) sfree(p);
+    }
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    long long misses = -1;
+    if (counter >= 0) {
+        ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(counter, &misses, sizeof(misses)) != sizeof(misses)) misses = -1;
+    }
+    return Result{ns / blocks, misses < 0 ? -1.0 : (double)misses / blocks};
+}
+
+static void printMisses(double misses) {
+    if (misses < 0) printf(" %12s", "n/a");
+    else printf(" %12.2f", misses);
+}
+
+int main(int argc, char** argv) {
+    size_t blocks = argc > 1 ? strtoul(argv[1], NULL, 10) : 2000000;
+    int counter = openMissCounter();
+    if (counter < 0) printf("perf events unavailable: cache misses are not counted\n");
+    std::vector<char> evict(EVICT_BYTES);
+    const size_t sizes[] = {16, 64, 128, 200, 1000, 4000};
+    printf("%6s %12s %12s %12s %12s\n", "size", "free ns", "sized ns", "free miss", "sized miss");
+    for (size_t size : sizes) {
+        //fewer large blocks, so every size fills about the same heap
+        size_t count = std::max<size_t>(blocks * 64 / std::max<size_t>(size, 64), 1);
+        Result plain = run(size, count, false, counter, evict);
+        Result sized = run(size, count, true, counter, evict);
+        printf("%6zu %12.1f %12.1f", size, plain.ns_per_free, sized.ns_per_free);
+        printMisses(plain.misses_per_free);
+        printMisses(sized.misses_per_free);
+        printf("\n");
+    }
+    if (counter >= 0) close(counter);
+    return 0;
+}
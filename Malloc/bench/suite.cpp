@@ -0,0 +1,329 @@
+// Allocator benchmark suite: runs the same workloads against one allocator
+// and prints one CSV line per workload. It is built once per allocator
+// (malloc_1, malloc_2, malloc_3 and the system malloc), see the Makefile.
+//
+// Columns:
+//  allocator,workload,ops,failed,ops_per_sec,p50_ns,p99_ns,peak_rss_kb,fragmentation
+// Latencies come from every 16th call. fragmentation is the share of the
+// peak RSS growth not covered by the peak of live requested bytes: headers,
+// size rounding and free memory the allocator holds on to.
+//
+// Each workload runs in a child process, so it starts on a fresh heap and
+// gets its own peak RSS. Every page of a new block is touched, so RSS
+// follows what the allocator actually hands out. malloc_1 and malloc_2 are
+// not thread-safe: their calls are serialized with a global lock. malloc_1
+// never frees, so once it has handed out MALLOC_1_BUDGET bytes its further
+// allocations are counted as failed instead of being made.
+//
+// To run:
+//  make bench-suite
+//  ./bench/suite_malloc_3 [scale] [--no-header]
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#if defined(BENCH_SYSTEM)
+static const char* ALLOCATOR = "system";
+static void* benchAlloc(size_t size) { return malloc(size); }
+static void benchFree(void* p) { free(p); }
+static void* benchRealloc(void* p, size_t, size_t size) { return realloc(p, size); }
+#else
+void* smalloc(size_t size);
+#if defined(BENCH_MALLOC_1)
+static const char* ALLOCATOR = "malloc_1";
+static void benchFree(void*) {}
+static void* benchRealloc(void* p, size_t old_size, size_t size) {
+    void* new_p = smalloc(size);
+    if (new_p && p) memcpy(new_p, p, std::min(old_size, size));
+    return new_p;
+}
+#else
+void sfree(void* p);
+void* srealloc(void* oldp, size_t size);
+static void benchFree(void* p) { sfree(p); }
+static void* benchRealloc(void* p, size_t, size_t size) { return srealloc(p, size); }
+#if defined(BENCH_MALLOC_2)
+static const char* ALLOCATOR = "malloc_2";
+#else
+static const char* ALLOCATOR = "malloc_3";
+#endif
+#endif
+static void* benchAlloc(size_t size) { return smalloc(size); }
+#endif
+
+#if defined(BENCH_MALLOC_1) || defined(BENCH_MALLOC_2)
+static std::mutex g_serial;
+#define SERIALIZED(call) ([&] { std::lock_guard<std::mutex> guard(g_serial); return call; }())
+#else
+#define SERIALIZED(call) (call)
+#endif
+
+static const int SAMPLE_EVERY = 16;
+static const size_t PAGE = 4096;
+#if defined(BENCH_MALLOC_1)
+static const size_t MALLOC_1_BUDGET = (size_t)1 << 30;
+static std::atomic<size_t> g_malloc_1_used(0);
+#endif
+
+//per-thread counters of one workload run
+struct Stats {
+    long ops = 0;
+    long failed = 0;
+    long live_bytes = 0;
+    long peak_live_bytes = 0;
+    std::vector<uint32_t> samples;
+};
+
+struct Slot {
+    char* p;
+    size_t size;
+};
+
+//the workloads' slot arrays, made resident before any RSS is measured
+static const int MAX_SLOTS = 65536;
+static std::vector<Slot> g_slots(MAX_SLOTS, Slot{NULL, 0});
+
+static uint64_t nowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static unsigned nextRandom(unsigned* seed) {
+    *seed = *seed * 1103515245 + 12345;
+    return *seed >> 8;
+}
+
+static bool overBudget(size_t size) {
+#if defined(BENCH_MALLOC_1)
+    return g_malloc_1_used.fetch_add(size) + size > MALLOC_1_BUDGET;
+#else
+    (void)size;
+    return false;
+#endif
+}
+
+static void touch(char* p, size_t from, size_t to) {
+    for (size_t i = from; i < to; i += PAGE) p[i] = 1;
+    p[to - 1] = 1;
+}
+
+//calls go through these, which count, sample and keep the live byte total
+static char* timedAlloc(Stats* stats, size_t size) {
+    if (overBudget(size)) {
+        stats->ops++;
+        stats->failed++;
+        return NULL;
+    }
+    bool sample = stats->ops++ % SAMPLE_EVERY == 0;
+    uint64_t start = sample ? nowNs() : 0;
+    char* p = (char*)SERIALIZED(benchAlloc(size));
+    if (sample) stats->samples.push_back(nowNs() - start);
+    if (!p) {
+        stats->failed++;
+        return NULL;
+    }
+    touch(p, 0, size);
+    stats->live_bytes += size;
+    stats->peak_live_bytes = std::max(stats->peak_live_bytes, stats->live_bytes);
+    return p;
+}
+
+static void timedFree(Stats* stats, Slot* slot) {
+    if (!slot->p) return;
+    bool sample = stats->ops++ % SAMPLE_EVERY == 0;
+    uint64_t start = sample ? nowNs() : 0;
+    SERIALIZED((benchFree(slot->p), 0));
+    if (sample) stats->samples.push_back(nowNs() - start);
+    stats->live_bytes -= slot->size;
+    slot->p = NULL;
+}
+
+static void timedRealloc(Stats* stats, Slot* slot, size_t size) {
+    if (overBudget(size)) {
+        stats->ops++;
+        stats->failed++;
+        return;
+    }
+    bool sample = stats->ops++ % SAMPLE_EVERY == 0;
+    uint64_t start = sample ? nowNs() : 0;
+    char* p = (char*)SERIALIZED(benchRealloc(slot->p, slot->size, size));
+    if (sample) stats->samples.push_back(nowNs() - start);
+    if (!p) {
+        stats->failed++;
+        return;
+    }
+    touch(p, slot->size, size);
+    stats->live_bytes += (long)size - (long)slot->size;
+    stats->peak_live_bytes = std::max(stats->peak_live_bytes, stats->live_bytes);
+    slot->p = p;
+    slot->size = size;
+}
+
+//random replacement over a working set, with sizes from next_size
+template <typename SizeFn>
+static void churn(Stats* stats, long ops, int slots, unsigned seed, SizeFn next_size) {
+    Slot* set = g_slots.data();
+    while (stats->ops < ops) {
+        Slot* slot = &set[nextRandom(&seed) % slots];
+        timedFree(stats, slot);
+        size_t size = next_size(&seed);
+        slot->p = timedAlloc(stats, size);
+        slot->size = size;
+    }
+    for (int i = 0; i < slots; ++i) timedFree(stats, &set[i]);
+}
+
+static void fixedChurn(Stats* stats, long ops) {
+    churn(stats, ops, MAX_SLOTS, 1, [](unsigned*) { return (size_t)64; });
+}
+
+//Pareto-distributed sizes from 16 bytes to 64 KB: mostly small, with a long tail
+static size_t powerLawSize(unsigned* seed) {
+    double u = (nextRandom(seed) % 1000000 + 1) / 1000001.0;
+    double size = 16.0 / std::pow(u, 1.0 / 1.2);
+    return (size_t)std::min(size, 65536.0);
+}
+
+static void powerLawChurn(Stats* stats, long ops) {
+    churn(stats, ops, MAX_SLOTS, 2, powerLawSize);
+}
+
+static void largeChurn(Stats* stats, long ops) {
+    churn(stats, ops / 64, 16, 3, [](unsigned* seed) {
+        return (size_t)128 * 1024 + nextRandom(seed) % (4 * 1024 * 1024);
+    });
+}
+
+//interleaved buffers grown by about 12% at a time up to 1 MB, then dropped
+static void reallocChains(Stats* stats, long ops) {
+    const int chains = 16;
+    Slot* set = g_slots.data();
+    unsigned seed = 4;
+    while (stats->ops < ops) {
+        Slot* slot = &set[nextRandom(&seed) % chains];
+        if (slot->size >= 1024 * 1024) {
+            timedFree(stats, slot);
+            slot->size = 0;
+        }
+        timedRealloc(stats, slot, slot->size + slot->size / 8 + 16);
+    }
+    for (int i = 0; i < chains; ++i) timedFree(stats, &set[i]);
+}
+
+//larson-style: each epoch, a new set of threads takes over the working sets
+//of the previous one, so most blocks are freed by a thread that did not
+//allocate them
+static void larson(Stats* stats, long ops) {
+    const int threads = 4;
+    const int slots = 8192;
+    const int epochs = 8;
+    static_assert(threads * slots <= MAX_SLOTS, "larson needs more slots");
+    std::vector<Stats> thread_stats(threads);
+    //live bytes move between threads, so the total is taken between epochs
+    long live_peak = 0;
+    for (int epoch = 0; epoch < epochs; ++epoch) {
+        std::vector<std::thread> pool;
+        for (int t = 0; t < threads; ++t) {
+            pool.emplace_back([&, t, epoch] {
+                Stats* mine = &thread_stats[t];
+                Slot* set = &g_slots[(t + epoch) % threads * slots];
+                unsigned seed = 5 + t * 7919 + epoch;
+                long target = mine->ops + ops / threads / epochs;
+                while (mine->ops < target) {
+                    Slot* slot = &set[nextRandom(&seed) % slots];
+                    timedFree(mine, slot);
+                    size_t size = 16 + nextRandom(&seed) % 512;
+                    slot->p = timedAlloc(mine, size);
+                    slot->size = size;
+                }
+            });
+        }
+        for (std::thread& thread : pool) thread.join();
+        long live = 0;
+        for (Stats& s : thread_stats) live += s.live_bytes;
+        live_peak = std::max(live_peak, live);
+    }
+    for (int t = 0; t < threads; ++t) {
+        for (int i = 0; i < slots; ++i) timedFree(&thread_stats[t], &g_slots[t * slots + i]);
+    }
+    for (Stats& s : thread_stats) {
+        stats->ops += s.ops;
+        stats->failed += s.failed;
+        stats->samples.insert(stats->samples.end(), s.samples.begin(), s.samples.end());
+    }
+    stats->peak_live_bytes = live_peak;
+}
+
+static long currentRssKb() {
+    long pages = 0;
+    FILE* statm = fopen("/proc/self/statm", "r");
+    if (statm) {
+        if (fscanf(statm, "%*s %ld", &pages) != 1) pages = 0;
+        fclose(statm);
+    }
+    return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static uint32_t percentile(std::vector<uint32_t>& samples, double fraction) {
+    if (samples.empty()) return 0;
+    size_t index = (size_t)(fraction * (samples.size() - 1));
+    std::nth_element(samples.begin(), samples.begin() + index, samples.end());
+    return samples[index];
+}
+
+static void run(const char* name, void (*workload)(Stats*, long), long ops) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid != 0) {
+        waitpid(pid, NULL, 0);
+        return;
+    }
+    long base_rss_kb = currentRssKb();
+    Stats stats;
+    stats.samples.reserve(ops / SAMPLE_EVERY + 1024);
+    uint64_t start = nowNs();
+    workload(&stats, ops);
+    double seconds = (nowNs() - start) / 1e9;
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    long growth_kb = std::max(usage.ru_maxrss - base_rss_kb, 1L);
+    double fragmentation = std::max(0.0, 1.0 - (double)stats.peak_live_bytes / 1024 / growth_kb);
+    uint32_t p50 = percentile(stats.samples, 0.50);
+    uint32_t p99 = percentile(stats.samples, 0.99);
+    printf("%s,%s,%ld,%ld,%.0f,%u,%u,%ld,%.3f\n", ALLOCATOR, name, stats.ops, stats.failed,
+           stats.ops / seconds, p50, p99, (long)usage.ru_maxrss, fragmentation);
+    fflush(stdout);
+    _exit(0);
+}
+
+int main(int argc, char** argv) {
+    double scale = 1;
+    bool header = true;
+    for (int i = 1; i < argc; ++i) {
+        if (std::string(argv[i]) == "--no-header") header = false;
+        else scale = atof(argv[i]);
+    }
+    long ops = (long)(500000 * scale);
+    if (header) {
+        printf("allocator,workload,ops,failed,ops_per_sec,p50_ns,p99_ns,peak_rss_kb,fragmentation\n");
+    }
+    run("fixed", fixedChurn, ops);
+    run("powerlaw", powerLawChurn, ops);
+    run("larson", larson, ops);
+    run("realloc", reallocChains, ops);
+    run("large", largeChurn, ops);
+    return 0;
+}
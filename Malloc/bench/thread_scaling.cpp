@@ -0,0 +1,51 @@
+// Scaling benchmark for malloc_3: every thread runs the same random
+// alloc/free mix over a private working set, for 1 to 64 threads.
+//
+// To run:
+//  ./bench/thread_scaling [ops per thread]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+#include "../malloc_3.h"
+
+static const int SLOTS = 64;
+static const size_t MAX_SIZE = 1024;
+
+static void worker(long ops, unsigned seed) {
+    void* slots[SLOTS] = {nullptr};
+    for (long i = 0; i < ops; ++i) {
+        seed = seed * 1103515245 + 12345;
+        int slot = (seed >> 8) % SLOTS;
+        if (slots[slot]) {
+            sfree(slots[slot]);
+            slots[slot] = nullptr;
+        } else {
+            size_t size = 16 + (seed >> 16) % MAX_SIZE;
+            slots[slot] = smalloc(size);
+            if (slots[slot]) *(char*)slots[slot] = 1;
+        }
+    }
+    for (int i = 0; i < SLOTS; ++i) {
+        sfree(slots[i]);
+    }
+}
+
+int main(int argc, char** argv) {
+    long ops = argc > 1 ? atol(argv[1]) : 1000000;
+    printf("%8s %14s %14s\n", "threads", "ops/sec", "ops/sec/thread");
+    for (int threads = 1; threads <= 64; threads *= 2) {
+        std::vector<std::thread> pool;
+        auto start = std::chrono::steady_clock::now();
+        for (int t = 0; t < threads; ++t) {
+            pool.emplace_back(worker, ops, (unsigned)(t + 1));
+        }
+        for (auto& th : pool) th.join();
+        double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        double total = (double)ops * threads / secs;
+        printf("%8d %14.0f %14.0f\n", threads, total, total / threads);
+    }
+    return 0;
+}
@@ -1,138 +1,332 @@
-#include <unistd.h>
-#include <cstring>
-
-const size_t MAX_ALLOC = 100000000;
-
-struct MallocMetadata {
-    size_t size;
-    bool is_free;
-    MallocMetadata* next;
-    MallocMetadata* prev;
-};
-
-MallocMetadata* blocklist = NULL;
-
-void* smalloc(size_t size) {
-    if(size > MAX_ALLOC || size == 0) {
-        return NULL;
-    }
-    // search for a free block
-    MallocMetadata* current = blocklist;
-    MallocMetadata* last = NULL;
-    while (current) {
-        if (current->is_free && current->size >= size) {
-          current->is_free = false;
-          return (void*)(current + 1);
-        }
-        last = current;
-        current = current->next;
-    }
-
-    //not found - allocate a new block
-    void* new_block_ptr = sbrk(size + sizeof(MallocMetadata));
-    if (new_block_ptr == (void*)-1) return NULL;
-
-    MallocMetadata* new_meta = (MallocMetadata*)new_block_ptr;
-    new_meta->is_free = false;
-    new_meta->size = size;
-    new_meta->next = NULL;
-    new_meta->prev = last;
-
-    //add the block to the end of the list
-    if (last) {
-      last->next = new_meta;
-    } else {
-      blocklist = new_meta;
-    }
-
-    return (void*)(new_meta + 1);
-}
-
-void* scalloc(size_t num, size_t size){
-    if (num == 0 || size == 0) {
-        return NULL;
-    }
-    if (num > 0 && size > MAX_ALLOC / num) {
-        return NULL;
-    }
-    void* ret = smalloc(num * size);
-    if(ret != NULL) {
-        std::memset(ret, 0, num * size);
-    }
-    return ret;
-}
-
-void sfree(void* p) {
-    if(p == NULL) return;
-    MallocMetadata* block_meta = (MallocMetadata*)p - 1;
-    block_meta->is_free = true;
-}
-
-void* srealloc(void* p, size_t size) {
-    if(p == NULL) {
-        return smalloc(size);
-    }
-
-    MallocMetadata* old_meta = (MallocMetadata*)p - 1;
-    if(size <= old_meta->size) {
-        return p;
-    }
-    void* new_p = smalloc(size);
-    if(new_p) {
-        std::memmove(new_p, p, old_meta->size);
-        sfree(p);
-    }
-    return new_p;
-}
-
-size_t _num_free_blocks() {
-    size_t count = 0;
-    MallocMetadata* current = blocklist;
-    while (current) {
-      if (current->is_free) {
-        count++;
-      }
-      current = current->next;
-    }
-    return count;
-}
-
-size_t _num_free_bytes() {
-  size_t total = 0;
-  MallocMetadata* current = blocklist;
-  while (current) {
-    if (current->is_free) {
-      total += current->size;
-    }
-    current = current->next;
-  }
-  return total;
-}
-
-size_t _num_allocated_blocks() {
-    size_t count = 0;
-    MallocMetadata* current = blocklist;
-    while (current) {
-      count++;
-      current = current->next;
-    }
-    return count;
-}
-
-size_t _num_allocated_bytes() {
-    size_t total = 0;
-    MallocMetadata* current = blocklist;
-    while (current) {
-      total += current->size;
-      current = current->next;
-    }
-    return total;
-}
-
-size_t _num_meta_data_bytes() {
-  return _num_allocated_blocks() * sizeof(MallocMetadata);
-}
-
-size_t _size_meta_data() {
-  return sizeof(MallocMetadata);
-}
+#include <unistd.h>
+#include <cstring>
+#include <cstdint>
+
+const size_t MAX_ALLOC = 100000000;
+const size_t ALIGNMENT = 8;
+//a free block is only split if the rest can hold a header and this much payload
+const size_t MIN_SPLIT_BYTES = 64;
+//free blocks are binned by size: one bin per ALIGNMENT step up to
+//SMALL_BIN_MAX, then BINS_PER_POWER bins per power of two
+const size_t SMALL_BIN_MAX = 512;
+const int SMALL_BIN_COUNT = SMALL_BIN_MAX / ALIGNMENT;
+const int BINS_PER_POWER = 4;
+const int FIRST_LARGE_LOG = 9; //log2(SMALL_BIN_MAX)
+const int BIN_COUNT = SMALL_BIN_COUNT + (64 - FIRST_LARGE_LOG) * BINS_PER_POWER;
+const int BIN_MASK_WORDS = (BIN_COUNT + 63) / 64;
+//blocks of a bin are not all large enough for every request mapped to it,
+//only this many are tried before moving on to a larger bin
+const int BIN_SCAN_LIMIT = 8;
+//a free block at the top of the heap is shrunk back to TRIM_KEEP_BYTES by
+//lowering the program break once it reaches TRIM_THRESHOLD
+const size_t TRIM_THRESHOLD = 4 * 1024 * 1024;
+const size_t TRIM_KEEP_BYTES = 1024 * 1024;
+
+//blocks sit back to back in segments of the heap, one segment per run of
+//sbrk calls that nobody else interleaved with. prev_size and is_last are the
+//boundary tags: they lead to the physical neighbours, so a freed block
+//merges with free ones on either side in O(1). next and prev link the free
+//blocks of one bin.
+struct MallocMetadata {
+    size_t size;      //payload bytes
+    size_t prev_size; //payload bytes of the block right below, 0 if it is first in its segment
+    bool is_free;
+    bool is_last;     //last block of its segment
+    MallocMetadata* next;
+    MallocMetadata* prev;
+};
+
+MallocMetadata* bins[BIN_COUNT] = {NULL};
+uint64_t bin_mask[BIN_MASK_WORDS] = {0}; //bit i set = bins[i] is not empty
+MallocMetadata* heap_top = NULL; //last block of the newest segment
+void* heap_end = NULL;           //address right past heap_top
+size_t block_count = 0;
+size_t block_bytes = 0;
+size_t free_block_count = 0;
+size_t free_block_bytes = 0;
+
+size_t alignSize(size_t size) {
+    return (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+}
+
+int binForSize(size_t size) {
+    if (size <= SMALL_BIN_MAX) return (int)(size / ALIGNMENT) - 1;
+    int log = 63 - __builtin_clzll(size);
+    int sub = (int)((size >> (log - 2)) & (BINS_PER_POWER - 1));
+    return SMALL_BIN_COUNT + (log - FIRST_LARGE_LOG) * BINS_PER_POWER + sub;
+}
+
+MallocMetadata* nextBlock(MallocMetadata* meta) {
+    return meta->is_last ? NULL : (MallocMetadata*)((char*)(meta + 1) + meta->size);
+}
+
+MallocMetadata* prevBlock(MallocMetadata* meta) {
+    return meta->prev_size ? (MallocMetadata*)((char*)meta - meta->prev_size) - 1 : NULL;
+}
+
+//writes the size of a block and the boundary tag of the block above it
+void setSize(MallocMetadata* meta, size_t size) {
+    meta->size = size;
+    MallocMetadata* next = nextBlock(meta);
+    if (next) next->prev_size = size;
+}
+
+void addToBin(MallocMetadata* meta) {
+    int bin = binForSize(meta->size);
+    meta->is_free = true;
+    meta->prev = NULL;
+    meta->next = bins[bin];
+    if (meta->next) meta->next->prev = meta;
+    bins[bin] = meta;
+    bin_mask[bin / 64] |= (uint64_t)1 << (bin % 64);
+    free_block_count++;
+    free_block_bytes += meta->size;
+}
+
+void removeFromBin(MallocMetadata* meta) {
+    int bin = binForSize(meta->size);
+    if (meta->prev) {
+        meta->prev->next = meta->next;
+    } else {
+        bins[bin] = meta->next;
+        if (!meta->next) bin_mask[bin / 64] &= ~((uint64_t)1 << (bin % 64));
+    }
+    if (meta->next) meta->next->prev = meta->prev;
+    meta->is_free = false;
+    free_block_count--;
+    free_block_bytes -= meta->size;
+}
+
+//first non-empty bin at or after bin, or -1
+int nextUsedBin(int bin) {
+    for (int word = bin / 64; word < BIN_MASK_WORDS; ++word) {
+        uint64_t bits = bin_mask[word];
+        if (word == bin / 64) bits &= ~(uint64_t)0 << (bin % 64);
+        if (bits) return word * 64 + __builtin_ctzll(bits);
+    }
+    return -1;
+}
+
+//a free block of at least size bytes, taken off its bin, or NULL
+MallocMetadata* findFreeBlock(size_t size) {
+    int bin = binForSize(size);
+    int scanned = 0;
+    for (MallocMetadata* current = bins[bin]; current && scanned < BIN_SCAN_LIMIT; current = current->next) {
+        if (current->size >= size) {
+            removeFromBin(current);
+            return current;
+        }
+        scanned++;
+    }
+    //every block of a larger bin is large enough
+    bin = nextUsedBin(bin + 1);
+    if (bin < 0) return NULL;
+    MallocMetadata* found = bins[bin];
+    removeFromBin(found);
+    return found;
+}
+
+//true when heap_top still ends at the program break, so it can be grown and
+//shrunk in place: nobody else has called sbrk since
+bool topAtBreak() {
+    return heap_top && sbrk(0) == heap_end;
+}
+
+//moves the program break so heap_top has size payload bytes. a free heap_top
+//must be off its bin
+bool resizeTop(size_t size) {
+    intptr_t delta = (intptr_t)size - (intptr_t)heap_top->size;
+    if (sbrk(delta) == (void*)-1) return false;
+    heap_top->size = size;
+    heap_end = (char*)heap_end + delta;
+    block_bytes += delta;
+    return true;
+}
+
+//puts a free block on its bin, shrinking it first if it is a large top block
+void releaseFree(MallocMetadata* meta) {
+    if (meta == heap_top && meta->size >= TRIM_THRESHOLD && topAtBreak()) {
+        resizeTop(TRIM_KEEP_BYTES);
+    }
+    addToBin(meta);
+}
+
+//cuts the payload of an allocated block down to size and frees the rest,
+//if the rest is worth a block of its own
+void splitBlock(MallocMetadata* meta, size_t size) {
+    if (meta->size < size + sizeof(MallocMetadata) + MIN_SPLIT_BYTES) return;
+    MallocMetadata* rest = (MallocMetadata*)((char*)(meta + 1) + size);
+    rest->is_last = meta->is_last;
+    rest->prev_size = size;
+    setSize(rest, meta->size - size - sizeof(MallocMetadata));
+    meta->is_last = false;
+    meta->size = size;
+    if (heap_top == meta) heap_top = rest;
+    block_count++;
+    block_bytes -= sizeof(MallocMetadata);
+    //a block taken from a bin has no free neighbours, but srealloc splits blocks in use
+    MallocMetadata* next = nextBlock(rest);
+    if (next && next->is_free) {
+        removeFromBin(next);
+        rest->is_last = next->is_last;
+        if (heap_top == next) heap_top = rest;
+        setSize(rest, rest->size + sizeof(MallocMetadata) + next->size);
+        block_count--;
+        block_bytes += sizeof(MallocMetadata);
+    }
+    releaseFree(rest);
+}
+
+//merges upper, which must be free and off its bin, into the block below it
+void absorbNext(MallocMetadata* meta, MallocMetadata* upper) {
+    meta->is_last = upper->is_last;
+    if (heap_top == upper) heap_top = meta;
+    setSize(meta, meta->size + sizeof(MallocMetadata) + upper->size);
+    block_count--;
+    block_bytes += sizeof(MallocMetadata);
+}
+
+//extends the heap by a new block of size payload bytes. the block continues
+//the newest segment unless someone else has moved the program break since.
+//a free block at the top is grown by just the missing bytes instead
+MallocMetadata* sbrkBlock(size_t size) {
+    if (heap_top && heap_top->is_free && topAtBreak()) {
+        MallocMetadata* top = heap_top;
+        removeFromBin(top);
+        if (top->size >= size || resizeTop(size)) return top;
+        addToBin(top);
+        return NULL;
+    }
+    void* current_brk = sbrk(0);
+    if (current_brk == (void*)-1) return NULL;
+    size_t pad = (ALIGNMENT - (uintptr_t)current_brk % ALIGNMENT) % ALIGNMENT;
+    void* old_brk = sbrk(pad + sizeof(MallocMetadata) + size);
+    if (old_brk == (void*)-1) return NULL;
+    MallocMetadata* meta = (MallocMetadata*)((char*)old_brk + pad);
+    meta->size = size;
+    meta->is_free = false;
+    meta->is_last = true;
+    meta->prev_size = 0;
+    if (heap_top && (void*)meta == heap_end) {
+        heap_top->is_last = false;
+        meta->prev_size = heap_top->size;
+    }
+    heap_top = meta;
+    heap_end = (char*)(meta + 1) + size;
+    block_count++;
+    block_bytes += size;
+    return meta;
+}
+
+void* smalloc(size_t size) {
+    if(size > MAX_ALLOC || size == 0) {
+        return NULL;
+    }
+    size = alignSize(size);
+    MallocMetadata* meta = findFreeBlock(size);
+    if (meta) {
+        splitBlock(meta, size);
+        return (void*)(meta + 1);
+    }
+
+    //not found - grow the heap
+    meta = sbrkBlock(size);
+    if (!meta) return NULL;
+    splitBlock(meta, size);
+    return (void*)(meta + 1);
+}
+
+void* scalloc(size_t num, size_t size){
+    if (num == 0 || size == 0) {
+        return NULL;
+    }
+    if (num > 0 && size > MAX_ALLOC / num) {
+        return NULL;
+    }
+    void* ret = smalloc(num * size);
+    if(ret != NULL) {
+        std::memset(ret, 0, num * size);
+    }
+    return ret;
+}
+
+void sfree(void* p) {
+    if(p == NULL) return;
+    MallocMetadata* block_meta = (MallocMetadata*)p - 1;
+    if (block_meta->is_free) return;
+    MallocMetadata* next = nextBlock(block_meta);
+    if (next && next->is_free) {
+        removeFromBin(next);
+        absorbNext(block_meta, next);
+    }
+    MallocMetadata* prev = prevBlock(block_meta);
+    if (prev && prev->is_free) {
+        removeFromBin(prev);
+        absorbNext(prev, block_meta);
+        block_meta = prev;
+    }
+    releaseFree(block_meta);
+}
+
+void* srealloc(void* p, size_t size) {
+    if(p == NULL) {
+        return smalloc(size);
+    }
+    if (size > MAX_ALLOC || size == 0) {
+        return NULL;
+    }
+
+    MallocMetadata* old_meta = (MallocMetadata*)p - 1;
+    size_t old_size = old_meta->size;
+    size = alignSize(size);
+    if(size <= old_size) {
+        splitBlock(old_meta, size);
+        return p;
+    }
+    //grow into a free block right above, if that is enough
+    MallocMetadata* next = nextBlock(old_meta);
+    if (next && next->is_free && old_size + sizeof(MallocMetadata) + next->size >= size) {
+        removeFromBin(next);
+        absorbNext(old_meta, next);
+        splitBlock(old_meta, size);
+        return p;
+    }
+    //the top block grows by moving the break, taking a free block above along
+    if (next && next->is_free && next == heap_top && topAtBreak()) {
+        removeFromBin(next);
+        absorbNext(old_meta, next);
+    }
+    if (old_meta == heap_top && topAtBreak() && resizeTop(size)) {
+        return p;
+    }
+    void* new_p = smalloc(size);
+    if(new_p) {
+        std::memmove(new_p, p, old_size);
+        sfree(p);
+    }
+    return new_p;
+}
+
+size_t _num_free_blocks() {
+    return free_block_count;
+}
+
+size_t _num_free_bytes() {
+    return free_block_bytes;
+}
+
+size_t _num_allocated_blocks() {
+    return block_count;
+}
+
+size_t _num_allocated_bytes() {
+    return block_bytes;
+}
+
+size_t _num_meta_data_bytes() {
+  return _num_allocated_blocks() * sizeof(MallocMetadata);
+}
+
+size_t _size_meta_data() {
+  return sizeof(MallocMetadata);
+}
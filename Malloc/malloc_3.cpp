@@ -1,295 +1,2129 @@
-#include <unistd.h>
-#include <cstring>
-#include <sys/mman.h>
-#include <cstdint>
-
-const size_t MAX_ALLOC = 100000000;
-const int MAX_ORDER = 10;
-const size_t MIN_BLOCK_SIZE_BYTES = 128;
-const size_t INITIAL_ARENA_BLOCKS = 32;
-const size_t MMAP_THRESHOLD = 128 * 1024;
-const size_t ARENA_SIZE = INITIAL_ARENA_BLOCKS * MMAP_THRESHOLD;
-
-
-struct MallocMetadata {
-    size_t size;
-    bool is_free;
-    bool is_mmaped;
-    int order;
-    MallocMetadata* next;
-    MallocMetadata* prev;
-};
-
-static bool g_is_initialized = false;
-static void* g_heap_start = nullptr;
-static size_t g_buddy_used_block_count = 0;
-static MallocMetadata* g_free_lists[MAX_ORDER + 1] = {nullptr};
-static MallocMetadata* g_mmap_list_head = nullptr;
-
-void addToFreeList(MallocMetadata* block);
-
-void initialize_allocator() {
-    if (g_is_initialized) return;
-    void* current_brk = sbrk(0);
-    uintptr_t aligned_addr = ((uintptr_t)current_brk + (ARENA_SIZE - 1)) & ~(ARENA_SIZE - 1);
-    size_t alignment_increment = aligned_addr - (uintptr_t)current_brk;
-    if (sbrk(alignment_increment) == (void*)-1) {
-        return;
-    }
-    g_heap_start = sbrk(ARENA_SIZE);
-    if (g_heap_start != (void*)aligned_addr || g_heap_start == (void*)-1) {
-        g_heap_start = nullptr;
-        return;
-    }
-
-  for (size_t i = 0; i < INITIAL_ARENA_BLOCKS; ++i) {
-    MallocMetadata* meta = (MallocMetadata*)((uintptr_t)g_heap_start + i * MMAP_THRESHOLD);
-    meta->size = MMAP_THRESHOLD;
-    meta->order = MAX_ORDER;
-    meta->is_mmaped = false;
-    meta->next = nullptr;
-    meta->prev = nullptr;
-    addToFreeList(meta);
-  }
-  g_is_initialized = true;
-}
-
-void removeFromFreeList(MallocMetadata* block) {
-  if (!block || !block->is_free) return;
-  if (block->prev) {
-    block->prev->next = block->next;
-  } else {
-      g_free_lists[block->order] = block->next;
-  }
-  if (block->next) {
-    block->next->prev = block->prev;
-  }
-  block->next = nullptr;
-  block->prev = nullptr;
-}
-
-void addToFreeList(MallocMetadata* block) {
-  if (!block) return;
-  block->is_free = true;
-  int order = block->order;
-  MallocMetadata* current = g_free_lists[order];
-  if (!current || block < current) {
-    block->next = current;
-    block->prev = nullptr;
-    if (current) {
-        current->prev = block;
-    }
-    g_free_lists[order] = block;
-    return;
-  }
-
-    while (current->next && current->next < block) {
-        current = current->next;
-    }
-
-    block->next = current->next;
-    block->prev = current;
-    if (current->next) {
-        current->next->prev = block;
-    }
-    current->next = block;
-}
-
-MallocMetadata* getBuddy(MallocMetadata* block) {
-  uintptr_t block_addr = (uintptr_t)block;
-  uintptr_t buddy_addr = block_addr ^ block->size; //XOR trick
-  return (MallocMetadata*)buddy_addr;
-}
-
-void* mmap_alloc(size_t size) {
-  size_t total_size = size + sizeof(MallocMetadata);
-  void* block = mmap(NULL, total_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-  if (block == MAP_FAILED) {
-    return NULL;
-  }
-  MallocMetadata* meta = (MallocMetadata*)block;
-  meta->size = total_size;
-  meta->is_free = false;
-  meta->is_mmaped = true;
-  meta->order = -1; //not part of buddy system
-
-  //add to the front of mmap'd list
-  meta->next = g_mmap_list_head;
-  meta->prev = nullptr;
-  if (g_mmap_list_head) {
-    g_mmap_list_head->prev = meta;
-  }
-  g_mmap_list_head = meta;
-
-  return (void*)(meta + 1);
-}
-
-void* smalloc(size_t size) {
-    if(size == 0 || size > MAX_ALLOC) {
-        return NULL;
-    }
-    initialize_allocator();
-
-    //challenge 3
-    if (size + sizeof(MallocMetadata) >= MMAP_THRESHOLD) {
-      return mmap_alloc(size);
-    }
-
-    //challenge 0
-    size_t required_total_size = size + sizeof(MallocMetadata);
-    int required_order = 0;
-    //calculate order
-    size_t current_block_size = MIN_BLOCK_SIZE_BYTES;
-    while (current_block_size < required_total_size) {
-        current_block_size <<= 1;
-        required_order++;
-    }
-    if (required_order > MAX_ORDER) return NULL;
-
-    //find the smallest large enough available block
-    int order_to_use = -1;
-    for (int i = required_order; i <= MAX_ORDER; ++i) {
-      if (g_free_lists[i]) {
-        order_to_use = i;
-        break;
-      }
-    }
-    if (order_to_use < 0) return NULL; //out of memory
-
-    MallocMetadata* block_to_alloc = g_free_lists[order_to_use];
-    removeFromFreeList(block_to_alloc);
-    g_buddy_used_block_count++;
-
-    //challenge 1
-    while (block_to_alloc->order > required_order) {
-      block_to_alloc->order--;
-      block_to_alloc->size /= 2;
-      MallocMetadata* buddy = getBuddy(block_to_alloc);
-      buddy->size = block_to_alloc->size;
-      buddy->order = block_to_alloc->order;
-      buddy->is_mmaped = false;
-      buddy->next = nullptr;
-      buddy->prev = nullptr;
-      buddy->is_free = true;
-      addToFreeList(buddy);
-    }
-
-    block_to_alloc->is_free = false;
-    block_to_alloc->next  = nullptr;
-    block_to_alloc->prev  = nullptr;
-
-    return (void*)(block_to_alloc + 1);
-}
-
-void* scalloc(size_t num, size_t size){
-    if (num == 0 || size == 0) {
-        return NULL;
-    }
-    if (num > 0 && size > MAX_ALLOC / num) {
-        return NULL;
-    }
-    void* ret = smalloc(num * size);
-    if(ret != NULL) {
-        std::memset(ret, 0, num * size);
-    }
-    return ret;
-}
-
-void sfree(void* p) {
-    if (!p) return;
-    MallocMetadata* block_to_free = (MallocMetadata*)p - 1;
-
-    //challenge 3
-    if (block_to_free->is_mmaped) {
-      if (block_to_free->prev) block_to_free->prev->next = block_to_free->next;
-      if (block_to_free->next) block_to_free->next->prev = block_to_free->prev;
-      if (g_mmap_list_head == block_to_free) g_mmap_list_head = block_to_free->next;
-      munmap(block_to_free, block_to_free->size);
-      return;
-    }
-    g_buddy_used_block_count--;
-    //challenge 2
-    while (block_to_free->order < MAX_ORDER) {
-      MallocMetadata* buddy = getBuddy(block_to_free);
-      if (!buddy->is_free || buddy->order != block_to_free->order) break;
-      removeFromFreeList(buddy);
-      if ((uintptr_t)buddy < (uintptr_t)block_to_free) block_to_free = buddy;
-      block_to_free->order++;
-      block_to_free->size *= 2;
-    }
-
-    addToFreeList(block_to_free);
-}
-
-void* srealloc(void* p, size_t size) {
-    if(p == NULL) {
-        return smalloc(size);
-    }
-    if (size == 0 || size > MAX_ALLOC) return NULL;
-
-    MallocMetadata* old_meta = (MallocMetadata*)p - 1;
-    size_t user_space = old_meta->is_mmaped ? old_meta->size - sizeof(MallocMetadata) : (MIN_BLOCK_SIZE_BYTES << old_meta->order) - sizeof(MallocMetadata);
-    if (size <= user_space) {
-        return p;
-    }
-
-    void* new_p = smalloc(size);
-    if (!new_p) return NULL;
-    std::memmove(new_p, p, user_space);
-    sfree(p);
-    return new_p;
-}
-
-size_t _num_free_blocks() {
-    size_t count = 0;
-    for (int i = 0; i <= MAX_ORDER; ++i) {
-        for (MallocMetadata* current = g_free_lists[i]; current; current = current->next) {
-            count++;
-        }
-    }
-    return count;
-}
-
-size_t _num_free_bytes() {
-    size_t total_bytes = 0;
-    for (int i = 0; i <= MAX_ORDER; ++i) {
-        for (MallocMetadata* current = g_free_lists[i]; current; current = current->next) {
-            total_bytes += (current->size - sizeof(MallocMetadata));
-        }
-    }
-    return total_bytes;
-}
-
-size_t _num_allocated_blocks() {
-    if (!g_is_initialized) return 0;
-
-    size_t count = _num_free_blocks() + g_buddy_used_block_count;
-
-    for (MallocMetadata* current = g_mmap_list_head; current; current = current->next) {
-        count++;
-    }
-    return count;
-}
-
-size_t _num_allocated_bytes() {
-    if (!g_is_initialized) return 0;
-
-    size_t total_bytes = _num_free_bytes();
-
-    size_t total_buddy_blocks = _num_free_blocks() + g_buddy_used_block_count;
-    size_t total_buddy_metadata = total_buddy_blocks * sizeof(MallocMetadata);
-    total_bytes = ARENA_SIZE - total_buddy_metadata;
-
-    for (MallocMetadata* current = g_mmap_list_head; current; current = current->next) {
-        total_bytes += (current->size - sizeof(MallocMetadata));
-    }
-    return total_bytes;
-}
-
-size_t _num_meta_data_bytes() {
-  return _num_allocated_blocks() * sizeof(MallocMetadata);
-}
-
-size_t _size_meta_data() {
-  return sizeof(MallocMetadata);
-}
+#include <unistd.h>
+#include <cstring>
+#include <sys/mman.h>
+#include <cstdint>
+#include <pthread.h>
+#include <sched.h>
+#include <atomic>
+#include <ctime>
+#include <algorithm>
+#include "malloc_3.h"
+
+#ifndef MALLOC3_GEOMETRY
+#define MALLOC3_GEOMETRY BalancedGeometry
+#endif
+
+//block sizes, orders and the mmap threshold come from the geometry an engine
+//is instantiated with (see BuddyEngine below); everything here is shared
+const size_t MAX_ALLOC = 100000000;
+//thread caches hold blocks of up to TCACHE_MAX_BLOCK_BYTES, at most
+//TCACHE_BIN_BYTES per order
+const size_t TCACHE_MAX_BLOCK_BYTES = 4096;
+const size_t TCACHE_BIN_BYTES = 8 * 1024;
+//requests up to SLAB_MAX_OBJECT bytes are packed into SLAB_SIZE buddy blocks
+//in size classes SLAB_CLASS_STEP bytes apart, with no per-object header
+const size_t SLAB_SIZE = 512;
+const size_t SLAB_CLASS_STEP = 16;
+const size_t SLAB_MAX_OBJECT = 128;
+const int SLAB_CLASS_COUNT = SLAB_MAX_OBJECT / SLAB_CLASS_STEP;
+//freed mmap'd blocks of up to LARGE_CACHE_MAX_ENTRY bytes are kept mapped for
+//reuse, LARGE_CACHE_MAX_BYTES in total, each for at most LARGE_CACHE_DECAY_NS
+const size_t PAGE_BYTES = 4096;
+const size_t LARGE_CACHE_MAX_BYTES = 64 * 1024 * 1024;
+const size_t LARGE_CACHE_MAX_ENTRY = 16 * 1024 * 1024;
+const uint64_t LARGE_CACHE_DECAY_NS = 1000000000;
+const int LARGE_CACHE_BUCKETS = 64;
+//transparent huge page size; arenas are aligned to it for free
+const size_t HUGE_PAGE_BYTES = 2 * 1024 * 1024;
+//one buddy heap per CPU, CPUs past MAX_HEAPS share them round-robin
+const int MAX_HEAPS = 64;
+//free max-order blocks are purged once their pages have gone unused this long
+const long DEFAULT_PURGE_DECAY_MS = 10000;
+
+
+//buddy and mmap'd blocks start with a single header word. the low
+//META_FLAG_BITS bits hold flags, the rest holds the order of a buddy block or
+//the mapped length of an mmap'd block. the header is what coalescing and the
+//free lists work with; freeing a payload looks it up in the block map instead
+//(see below). headers are accessed with relaxed atomics, so reading one
+//before the heap it belongs to is locked is well defined. an over-aligned
+//payload is preceded by a META_ALIGNED word, holding the distance from the
+//payload back to the real header. META_ZERO marks a free block whose payload
+//past the free list links has never been written since the kernel handed it
+//over zeroed.
+struct MallocMetadata {
+    size_t word;
+};
+
+const size_t META_FREE = 1;
+const size_t META_MMAPED = 2;
+const size_t META_HUGE = 4; //mmap'd block marked MADV_HUGEPAGE
+const size_t META_ALIGNED = 8;
+const size_t META_ZERO = 16;
+const int META_FLAG_BITS = 5;
+
+//block map: a three-level radix tree over the 48-bit address space, like
+//tcmalloc's page map, with one entry byte per MIN_BLOCK_SIZE_BYTES unit. the
+//unit a payload starts in gives its kind and its order or slab class, so a
+//payload is freed without reading the memory around it, and a pointer the
+//allocator never handed out is told apart. the root has MAP_ROOT_BITS worth
+//of mid nodes, a leaf covers one ARENA_SIZE chunk and a mid node whatever
+//lies in between. nodes are mapped on first use, wherever arenas and
+//mappings land, and never unmapped, so lookups take no lock.
+const int MAP_ADDRESS_BITS = 48;
+const int MAP_ROOT_BITS = 13;
+
+//an entry holds the kind in its low MAP_KIND_BITS bits and a value above
+//them: the order of a buddy or carried block, or the size class of a slab
+//unit. an over-aligned payload is MAP_ALIGNED only when it starts in another
+//unit than its block; otherwise its unit shows the block, at a different offset.
+const uint8_t MAP_NONE = 0; //no payload starts here
+const uint8_t MAP_BUDDY = 1;
+const uint8_t MAP_SLAB = 2;
+const uint8_t MAP_CARRIED = 3;
+const uint8_t MAP_MMAP = 4;
+const uint8_t MAP_ALIGNED = 5;
+const int MAP_KIND_BITS = 3;
+static_assert(SLAB_CLASS_COUNT <= 1 << (8 - MAP_KIND_BITS), "slab classes must fit a map entry");
+
+//a free buddy block. the list links only exist while the block is free,
+//an allocated block hands them out as payload.
+struct FreeBlock {
+    MallocMetadata meta;
+    FreeBlock* next;
+    FreeBlock* prev;
+};
+
+//a free max-order block whose pages still hold data, on its heap's dirty
+//list until it is purged or taken off the free lists
+struct DirtyBlock {
+    FreeBlock block;
+    uint64_t freed_at;
+    DirtyBlock* newer;
+    DirtyBlock* older;
+};
+
+//lives right after the MallocMetadata of a slab block, objects follow it.
+//a slab block is aligned to SLAB_SIZE like any buddy block to its size, so an
+//object finds its slab by rounding its address down
+struct Slab {
+    uint64_t free_mask; //bit i set = object i is free
+    int size_class;
+    int object_count;
+    Slab* next;
+    Slab* prev;
+};
+
+//objects start 16-byte aligned after the header word and the Slab
+const size_t SLAB_OBJECTS_OFFSET = (sizeof(MallocMetadata) + sizeof(Slab) + 15) & ~(size_t)15;
+
+//a cached large mapping, written over the start of the mapping itself. it is
+//on the list of its page-count bucket and on one list ordered by free time.
+struct CachedMapping {
+    size_t length;
+    uint64_t freed_at;
+    bool huge;
+    CachedMapping* bucket_next;
+    CachedMapping* bucket_prev;
+    CachedMapping* age_next; //towards newer
+    CachedMapping* age_prev; //towards older
+};
+
+//blocks freed by one thread, linked through the first word of the payload.
+//count is atomic only so the stats functions may read it from other threads,
+//the owning thread never does a read-modify-write on it.
+struct TCacheBin {
+    void* head;
+    std::atomic<size_t> count;
+};
+
+size_t readMeta(MallocMetadata* meta) {
+  return __atomic_load_n(&meta->word, __ATOMIC_RELAXED);
+}
+
+void writeMeta(MallocMetadata* meta, size_t word) {
+  __atomic_store_n(&meta->word, word, __ATOMIC_RELAXED);
+}
+
+void setBuddyMeta(MallocMetadata* meta, int order, size_t flags) {
+  writeMeta(meta, ((size_t)order << META_FLAG_BITS) | flags);
+}
+
+int blockOrder(MallocMetadata* meta) {
+  return (int)(readMeta(meta) >> META_FLAG_BITS);
+}
+
+bool isMmaped(MallocMetadata* meta) {
+  return readMeta(meta) & META_MMAPED;
+}
+
+size_t mmapLength(MallocMetadata* meta) {
+  return readMeta(meta) & ~(((size_t)1 << META_FLAG_BITS) - 1);
+}
+
+uint8_t mapEntry(uint8_t kind, int value) {
+  return (uint8_t)(kind | value << MAP_KIND_BITS);
+}
+
+uint8_t mapKind(uint8_t entry) {
+  return entry & ((1 << MAP_KIND_BITS) - 1);
+}
+
+int mapValue(uint8_t entry) {
+  return entry >> MAP_KIND_BITS;
+}
+
+//the node in slot, mapped zeroed and installed if there is none yet. two
+//threads may race to install one, the loser unmaps its own
+template <typename Node>
+Node* mapNode(std::atomic<Node*>* slot) {
+  Node* node = slot->load(std::memory_order_acquire);
+  if (node) return node;
+  void* fresh = mmap(NULL, sizeof(Node), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (fresh == MAP_FAILED) return NULL;
+  if (slot->compare_exchange_strong(node, (Node*)fresh, std::memory_order_acq_rel, std::memory_order_acquire)) {
+    return (Node*)fresh;
+  }
+  munmap(fresh, sizeof(Node));
+  return node;
+}
+
+//maps length + alignment bytes and trims the mapping down to an aligned one
+void* mmapAligned(size_t length, size_t alignment) {
+    void* region = mmap(NULL, length + alignment, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED) return NULL;
+    uintptr_t start = (uintptr_t)region;
+    uintptr_t aligned_addr = (start + (alignment - 1)) & ~(alignment - 1);
+    if (aligned_addr > start) munmap(region, aligned_addr - start);
+    size_t tail = start + alignment - aligned_addr;
+    if (tail) munmap((void*)(aligned_addr + length), tail);
+    return (void*)aligned_addr;
+}
+
+//large mapping cache. buckets split every power of two of pages into four,
+//so a reused mapping is never more than about half again the requested size
+int largeCacheBucket(size_t pages) {
+  int log = 63 - __builtin_clzll(pages);
+  int sub = log >= 2 ? (int)((pages >> (log - 2)) & 3) : 0;
+  return log * 4 + sub;
+}
+
+uint64_t monotonicNs() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+size_t mmapLengthFor(size_t size) {
+  return (size + sizeof(MallocMetadata) + PAGE_BYTES - 1) & ~(PAGE_BYTES - 1);
+}
+
+int slabClassForSize(size_t size) {
+    return (int)((size + SLAB_CLASS_STEP - 1) / SLAB_CLASS_STEP) - 1;
+}
+
+size_t slabObjectSize(int size_class) {
+    return (size_t)(size_class + 1) * SLAB_CLASS_STEP;
+}
+
+void tcachePush(TCacheBin* bin, void* p) {
+  *(void**)p = bin->head;
+  bin->head = p;
+  bin->count.store(bin->count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+void* tcachePop(TCacheBin* bin) {
+  void* p = bin->head;
+  if (!p) return NULL;
+  bin->head = *(void**)p;
+  bin->count.store(bin->count.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+  return p;
+}
+
+constexpr int log2Of(size_t n) {
+  return n > 1 ? 1 + log2Of(n >> 1) : 0;
+}
+
+constexpr bool isPowerOfTwo(size_t n) {
+  return n && !(n & (n - 1));
+}
+
+//the buddy allocator, compiled once per geometry (see malloc_3.h), so block
+//sizes, order math and the split and merge loops work with constants. every
+//instantiation has heaps, a block map, thread caches and settings of its own:
+//a block must go back to the engine that handed it out, and any other engine
+//ignores it. the public functions at the bottom forward to the engine of
+//MALLOC3_GEOMETRY.
+template <typename Geometry>
+struct BuddyEngine {
+  static const size_t MIN_BLOCK_SIZE_BYTES = Geometry::MIN_BLOCK_SIZE_BYTES;
+  static const int MAX_ORDER = Geometry::MAX_ORDER;
+  static const size_t INITIAL_ARENA_BLOCKS = Geometry::INITIAL_ARENA_BLOCKS;
+  static const size_t MMAP_THRESHOLD = Geometry::MMAP_THRESHOLD;
+  static const size_t MAX_BLOCK_BYTES = MIN_BLOCK_SIZE_BYTES << MAX_ORDER;
+  static const size_t ARENA_SIZE = INITIAL_ARENA_BLOCKS * MAX_BLOCK_BYTES;
+  static const int MIN_BLOCK_SHIFT = log2Of(MIN_BLOCK_SIZE_BYTES);
+  static const int TCACHE_MAX_ORDER = log2Of(TCACHE_MAX_BLOCK_BYTES / MIN_BLOCK_SIZE_BYTES);
+  static const int SLAB_ORDER = log2Of(SLAB_SIZE / MIN_BLOCK_SIZE_BYTES);
+  //a map unit is the smallest block, a map leaf covers one arena
+  static const int MAP_UNIT_BITS = MIN_BLOCK_SHIFT;
+  static const int MAP_LEAF_BITS = log2Of(ARENA_SIZE) - MAP_UNIT_BITS;
+  static const int MAP_MID_BITS = MAP_ADDRESS_BITS - MAP_ROOT_BITS - MAP_LEAF_BITS - MAP_UNIT_BITS;
+
+  static_assert(isPowerOfTwo(MIN_BLOCK_SIZE_BYTES) && isPowerOfTwo(INITIAL_ARENA_BLOCKS),
+                "block and arena sizes must be powers of two");
+  static_assert(MIN_BLOCK_SIZE_BYTES <= SLAB_SIZE, "a slab must be a whole buddy block");
+  static_assert(MAX_BLOCK_BYTES > PAGE_BYTES, "purging keeps the first page of a max-order block");
+  static_assert(MAX_ORDER < HEAP_STATS_ORDERS, "HeapStats must cover every order");
+  static_assert(MAX_ORDER < 1 << (8 - MAP_KIND_BITS), "orders must fit a map entry");
+  static_assert(MMAP_THRESHOLD <= MAX_BLOCK_BYTES, "requests below the mmap threshold must fit a buddy block");
+  static_assert(ARENA_SIZE % HUGE_PAGE_BYTES == 0, "arenas must be hugepage aligned");
+  static_assert(MAP_MID_BITS > 0, "arenas too large for the block map");
+
+  struct MapLeaf {
+      uint8_t units[1 << MAP_LEAF_BITS];
+  };
+
+  struct MapMid {
+      std::atomic<MapLeaf*> leaves[1 << MAP_MID_BITS];
+  };
+
+  //an arena is an ARENA_SIZE-aligned region carved into buddy blocks. its first
+  //order-0 block is never handed out and holds this record, so the arena of any
+  //block is found by rounding the block address down to ARENA_SIZE.
+  struct Heap;
+
+  struct Arena {
+      MallocMetadata meta;
+      Heap* heap; //the heap whose free lists hold this arena's blocks
+      size_t used_blocks; //allocated buddy blocks, the Arena block itself not included
+      bool from_sbrk;
+      bool huge; //marked MADV_HUGEPAGE
+  };
+  static_assert(sizeof(Arena) <= MIN_BLOCK_SIZE_BYTES, "the Arena record must fit the smallest block");
+
+  struct TCache {
+      TCacheBin bins[TCACHE_MAX_ORDER + 1];
+      TCacheBin slab_bins[SLAB_CLASS_COUNT];
+      bool registered;
+      TCache* next;
+      TCache* prev;
+  };
+
+  //a buddy heap: arenas, free lists and slabs behind one lock. threads allocate
+  //from the heap of the CPU they run on, and a block always goes back to the
+  //heap that owns its arena, whichever thread frees it. heaps are aligned to a
+  //cache line so two CPUs never write the same one.
+  struct Heap {
+      pthread_mutex_t lock;
+      bool is_initialized;
+      size_t arena_count;
+      size_t empty_arena_count;
+      size_t used_block_count;
+      FreeBlock* free_lists[MAX_ORDER + 1];
+      uint32_t free_order_mask; //bit i set = free_lists[i] is not empty
+      size_t free_counts[MAX_ORDER + 1]; //length of each free list
+      size_t free_list_bytes; //whole-block bytes on the free lists
+      size_t slab_count;
+      Slab* partial_slabs[SLAB_CLASS_COUNT]; //slabs with a free object
+      DirtyBlock* dirty_oldest;
+      DirtyBlock* dirty_newest;
+      size_t zero_bytes; //bytes of free blocks flagged META_ZERO: never touched or purged
+      size_t peak_in_use_bytes; //highest in_use_bytes seen, see notePeak
+      std::atomic<size_t> in_use_bytes; //written under lock, read by notePeak of other heaps
+      //payloads freed from other CPUs in remote free mode, linked through their
+      //first word. on a line of its own: other CPUs write it, the owner polls it
+      alignas(64) std::atomic<void*> remote_frees;
+  } __attribute__((aligned(64)));
+
+  //all zero, which on Linux is PTHREAD_MUTEX_INITIALIZER: static zero
+  //initialization makes the heaps usable before any constructor has run.
+  //every static member is defined with a constant initializer below the class
+  static Heap g_heaps[MAX_HEAPS];
+  static std::atomic<int> g_heap_limit; //heaps past it have never been initialized
+  static std::atomic<bool> g_sbrk_claimed;
+  //mid nodes of the block map, mapped on demand. static zero initialization
+  //makes the map usable before any constructor has run, like the heaps
+  static std::atomic<MapMid*> g_map_root[1 << MAP_ROOT_BITS];
+
+  //g_global_lock protects the mmap'd block count, the large mapping cache and
+  //the thread cache list. fork takes every heap lock in index order and then
+  //this one; no other code holds two of these locks at once.
+  static pthread_mutex_t g_global_lock;
+  static size_t g_mmap_block_count;
+  static CachedMapping* g_large_cache[LARGE_CACHE_BUCKETS];
+  static CachedMapping* g_large_cache_oldest;
+  static CachedMapping* g_large_cache_newest;
+  static size_t g_large_cache_bytes;
+  static TCache* g_tcache_list;
+  //counters shared by the heaps are atomic instead of locked
+  static std::atomic<size_t> g_mmap_bytes; //payload bytes of all mmap'd blocks
+  static std::atomic<size_t> g_peak_in_use_bytes;
+  static std::atomic<size_t> g_realloc_copies_avoided;
+  static std::atomic<bool> g_hugepages;
+  static std::atomic<size_t> g_hugepage_min_bytes;
+  static std::atomic<size_t> g_hugepage_bytes; //bytes of arenas and live mappings marked MADV_HUGEPAGE
+  static std::atomic<bool> g_remote_frees;
+  static std::atomic<long> g_purge_decay_ms; //negative = never purge
+  static std::atomic<size_t> g_purged_bytes;
+  //the optional purge thread. g_purge_config_lock serializes spurge calls,
+  //g_purge_lock guards the stop flag the thread waits on
+  static pthread_mutex_t g_purge_config_lock;
+  static pthread_mutex_t g_purge_lock;
+  static pthread_cond_t g_purge_wake;
+  static bool g_purge_thread_running;
+  static bool g_purge_thread_stop;
+  static pthread_t g_purge_thread;
+
+  static pthread_key_t g_tcache_key;
+  static pthread_once_t g_process_hooks_once;
+  static thread_local TCache t_cache;
+
+  static size_t blockSize(int order) {
+    return MIN_BLOCK_SIZE_BYTES << order;
+  }
+
+  static size_t mapRootIndex(uintptr_t addr) {
+    return addr >> (MAP_ADDRESS_BITS - MAP_ROOT_BITS);
+  }
+
+  static size_t mapMidIndex(uintptr_t addr) {
+    return (addr >> (MAP_UNIT_BITS + MAP_LEAF_BITS)) & ((1 << MAP_MID_BITS) - 1);
+  }
+
+  //the entry of the unit holding addr, or NULL if no node covers it yet
+  static uint8_t* mapUnit(uintptr_t addr) {
+    if (addr >> MAP_ADDRESS_BITS) return NULL;
+    MapMid* mid = g_map_root[mapRootIndex(addr)].load(std::memory_order_acquire);
+    if (!mid) return NULL;
+    MapLeaf* leaf = mid->leaves[mapMidIndex(addr)].load(std::memory_order_acquire);
+    if (!leaf) return NULL;
+    return &leaf->units[(addr >> MAP_UNIT_BITS) & ((1 << MAP_LEAF_BITS) - 1)];
+  }
+
+  static uint8_t mapLookup(const void* p) {
+    uint8_t* unit = mapUnit((uintptr_t)p);
+    return unit ? __atomic_load_n(unit, __ATOMIC_RELAXED) : MAP_NONE;
+  }
+
+  //the chunk of addr must have been reserved
+  static void mapSet(const void* addr, uint8_t entry) {
+    __atomic_store_n(mapUnit((uintptr_t)addr), entry, __ATOMIC_RELAXED);
+  }
+
+  //maps the nodes covering the ARENA_SIZE chunk of addr. every arena and
+  //mapping is reserved before any of its payloads is entered
+  static bool mapReserve(const void* addr) {
+    uintptr_t key = (uintptr_t)addr;
+    if (key >> MAP_ADDRESS_BITS) return false;
+    MapMid* mid = mapNode(&g_map_root[mapRootIndex(key)]);
+    return mid && mapNode(&mid->leaves[mapMidIndex(key)]);
+  }
+
+  //true when p is where a buddy or mmap'd block's payload starts, right past
+  //its header, and not an over-aligned payload further into the unit
+  static bool atPayloadStart(void* p) {
+    return ((uintptr_t)p & (MIN_BLOCK_SIZE_BYTES - 1)) == sizeof(MallocMetadata);
+  }
+
+  static void dirtyUnlink(Heap* heap, DirtyBlock* block) {
+    if (block->older) block->older->newer = block->newer;
+    else heap->dirty_oldest = block->newer;
+    if (block->newer) block->newer->older = block->older;
+    else heap->dirty_newest = block->older;
+  }
+
+  static void dirtyAppend(Heap* heap, DirtyBlock* block) {
+    block->freed_at = monotonicNs();
+    block->newer = nullptr;
+    block->older = heap->dirty_newest;
+    if (heap->dirty_newest) heap->dirty_newest->newer = block;
+    else heap->dirty_oldest = block;
+    heap->dirty_newest = block;
+  }
+
+  //every free max-order block without META_ZERO is on the dirty list
+  static void removeFromFreeList(Heap* heap, FreeBlock* block) {
+    if (!block) return;
+    int order = blockOrder(&block->meta);
+    size_t zero_flag = readMeta(&block->meta) & META_ZERO;
+    if (zero_flag) heap->zero_bytes -= blockSize(order);
+    else if (order == MAX_ORDER) dirtyUnlink(heap, (DirtyBlock*)block);
+    if (block->prev) {
+      block->prev->next = block->next;
+    } else {
+        heap->free_lists[order] = block->next;
+        if (!block->next) heap->free_order_mask &= ~(1u << order);
+    }
+    if (block->next) {
+      block->next->prev = block->prev;
+    }
+    heap->free_counts[order]--;
+    heap->free_list_bytes -= blockSize(order);
+    block->next = nullptr;
+    block->prev = nullptr;
+  }
+
+  //lists are LIFO: the most recently freed block is reused first, while its
+  //lines are still likely to be cached
+  static void addToFreeList(Heap* heap, FreeBlock* block) {
+    if (!block) return;
+    writeMeta(&block->meta, readMeta(&block->meta) | META_FREE);
+    int order = blockOrder(&block->meta);
+    FreeBlock* current = heap->free_lists[order];
+    block->next = current;
+    block->prev = nullptr;
+    if (current) {
+        current->prev = block;
+    }
+    heap->free_lists[order] = block;
+    heap->free_order_mask |= 1u << order;
+    heap->free_counts[order]++;
+    heap->free_list_bytes += blockSize(order);
+    if (readMeta(&block->meta) & META_ZERO) heap->zero_bytes += blockSize(order);
+    else if (order == MAX_ORDER) dirtyAppend(heap, (DirtyBlock*)block);
+  }
+
+  static FreeBlock* getBuddy(FreeBlock* block, int order) {
+    uintptr_t block_addr = (uintptr_t)block;
+    uintptr_t buddy_addr = block_addr ^ blockSize(order); //XOR trick
+    return (FreeBlock*)buddy_addr;
+  }
+
+  //bytes handed out of the heaps' free lists or mapped for large blocks
+  static size_t inUseBytes() {
+    size_t total = g_mmap_bytes.load(std::memory_order_relaxed);
+    int limit = g_heap_limit.load(std::memory_order_relaxed);
+    for (int i = 0; i < limit; ++i) total += g_heaps[i].in_use_bytes.load(std::memory_order_relaxed);
+    return total;
+  }
+
+  static void notePeakTotal() {
+    size_t in_use = inUseBytes();
+    size_t peak = g_peak_in_use_bytes.load(std::memory_order_relaxed);
+    while (in_use > peak && !g_peak_in_use_bytes.compare_exchange_weak(peak, in_use, std::memory_order_relaxed)) {}
+  }
+
+  //caller must hold the heap's lock. publishes the heap's usage and sums up all
+  //heaps only when this one passes its own peak, so with several heaps the
+  //recorded peak is a lower bound: a high made of heaps that are each below
+  //their own peak is missed
+  static void notePeak(Heap* heap) {
+    size_t in_use = heap->arena_count * ARENA_SIZE - heap->free_list_bytes;
+    heap->in_use_bytes.store(in_use, std::memory_order_relaxed);
+    if (in_use <= heap->peak_in_use_bytes) return;
+    heap->peak_in_use_bytes = in_use;
+    notePeakTotal();
+  }
+
+  static Arena* arenaOf(void* p) {
+    return (Arena*)((uintptr_t)p & ~(uintptr_t)(ARENA_SIZE - 1));
+  }
+
+  static Heap* heapOf(void* p) {
+    return arenaOf(p)->heap;
+  }
+
+  //the heap of the CPU the calling thread runs on. the thread may migrate right
+  //after, which only costs locality
+  static Heap* localHeap() {
+    int cpu = sched_getcpu();
+    return &g_heaps[cpu < 0 ? 0 : cpu % MAX_HEAPS];
+  }
+
+  //gives the pages of dirty blocks freed at least the decay window ago back to
+  //the kernel with MADV_DONTNEED, which also zeroes them. the first page keeps
+  //the header and list links mapped and is cleared by hand, so the whole
+  //block can be flagged META_ZERO. caller must hold the heap's lock
+  static void purgeDecayed(Heap* heap, uint64_t now) {
+    long decay_ms = g_purge_decay_ms.load(std::memory_order_relaxed);
+    if (decay_ms < 0) return;
+    uint64_t decay_ns = (uint64_t)decay_ms * 1000000;
+    while (heap->dirty_oldest && heap->dirty_oldest->freed_at + decay_ns <= now) {
+      DirtyBlock* dirty = heap->dirty_oldest;
+      dirtyUnlink(heap, dirty);
+      std::memset(dirty + 1, 0, PAGE_BYTES - sizeof(DirtyBlock));
+      dirty->freed_at = 0;
+      dirty->newer = nullptr;
+      dirty->older = nullptr;
+      madvise((char*)dirty + PAGE_BYTES, blockSize(MAX_ORDER) - PAGE_BYTES, MADV_DONTNEED);
+      writeMeta(&dirty->block.meta, readMeta(&dirty->block.meta) | META_ZERO);
+      heap->zero_bytes += blockSize(MAX_ORDER);
+      g_purged_bytes.fetch_add(blockSize(MAX_ORDER), std::memory_order_relaxed);
+    }
+  }
+
+  //every allocation path goes through here, so this is where a heap takes
+  //back the blocks other CPUs have queued for it, and purges on a heap whose
+  //frees have stopped
+  static Heap* lockLocalHeap() {
+    Heap* heap = localHeap();
+    pthread_mutex_lock(&heap->lock);
+    drainRemoteFrees(heap);
+    if (heap->dirty_oldest) purgeDecayed(heap, monotonicNs());
+    return heap;
+  }
+
+  //moves the lock held from *locked to heap, for passes over blocks that may
+  //belong to different heaps. either may be NULL
+  static void switchHeap(Heap** locked, Heap* heap) {
+    if (*locked == heap) return;
+    if (*locked) pthread_mutex_unlock(&(*locked)->lock);
+    if (heap) pthread_mutex_lock(&heap->lock);
+    *locked = heap;
+  }
+
+  //extends the program break to the next ARENA_SIZE boundary plus one arena
+  static void* sbrkArenaMemory() {
+      void* current_brk = sbrk(0);
+      if (current_brk == (void*)-1) return NULL;
+      uintptr_t aligned_addr = ((uintptr_t)current_brk + (ARENA_SIZE - 1)) & ~(ARENA_SIZE - 1);
+      size_t increment = aligned_addr - (uintptr_t)current_brk + ARENA_SIZE;
+      void* old_brk = sbrk(increment);
+      if (old_brk == (void*)-1) return NULL;
+      //someone else may have moved the break in between, realign inside what we got
+      aligned_addr = ((uintptr_t)old_brk + (ARENA_SIZE - 1)) & ~(ARENA_SIZE - 1);
+      if (aligned_addr + ARENA_SIZE > (uintptr_t)old_brk + increment || !mapReserve((void*)aligned_addr)) {
+          sbrk(-(intptr_t)increment);
+          return NULL;
+      }
+      return (void*)aligned_addr;
+  }
+
+  //caller must hold the heap's lock
+  static void addArena(Heap* heap, void* base, bool from_sbrk) {
+    Arena* arena = (Arena*)base;
+    setBuddyMeta(&arena->meta, 0, 0);
+    arena->heap = heap;
+    arena->used_blocks = 0;
+    arena->from_sbrk = from_sbrk;
+    arena->huge = g_hugepages.load(std::memory_order_relaxed);
+    if (arena->huge) {
+      madvise(base, ARENA_SIZE, MADV_HUGEPAGE);
+      g_hugepage_bytes.fetch_add(ARENA_SIZE, std::memory_order_relaxed);
+    }
+    //the first max-order block is split all the way down around the Arena block
+    for (int order = 0; order < MAX_ORDER; ++order) {
+      FreeBlock* block = (FreeBlock*)((uintptr_t)base + blockSize(order));
+      setBuddyMeta(&block->meta, order, META_ZERO);
+      addToFreeList(heap, block);
+    }
+    for (size_t i = 1; i < INITIAL_ARENA_BLOCKS; ++i) {
+      FreeBlock* block = (FreeBlock*)((uintptr_t)base + i * MAX_BLOCK_BYTES);
+      setBuddyMeta(&block->meta, MAX_ORDER, META_ZERO);
+      addToFreeList(heap, block);
+    }
+    heap->arena_count++;
+    heap->empty_arena_count++;
+  }
+
+  //caller must hold the heap's lock. the arena must have no allocated blocks
+  static void releaseArena(Arena* arena) {
+    Heap* heap = arena->heap;
+    uintptr_t end = (uintptr_t)arena + ARENA_SIZE;
+    uintptr_t addr = (uintptr_t)arena + MIN_BLOCK_SIZE_BYTES;
+    while (addr < end) {
+      FreeBlock* block = (FreeBlock*)addr;
+      removeFromFreeList(heap, block);
+      addr += blockSize(blockOrder(&block->meta));
+    }
+    heap->arena_count--;
+    if (arena->huge) g_hugepage_bytes.fetch_sub(ARENA_SIZE, std::memory_order_relaxed);
+    munmap(arena, ARENA_SIZE);
+  }
+
+  //caller must hold the heap's lock. keeps at most one empty arena per heap
+  //mapped, so a heap that hovers around an arena boundary does not map and
+  //unmap on every call
+  static void arenaBlockFreed(Arena* arena, size_t count) {
+    arena->used_blocks -= count;
+    if (arena->used_blocks) return;
+    if (!arena->from_sbrk && arena->heap->empty_arena_count > 0) {
+      releaseArena(arena);
+      return;
+    }
+    arena->heap->empty_arena_count++;
+  }
+
+  static void arenaBlockAllocated(Arena* arena, size_t count) {
+    if (arena->used_blocks == 0) arena->heap->empty_arena_count--;
+    arena->used_blocks += count;
+  }
+
+  //caller must hold the heap's lock
+  static bool growHeap(Heap* heap) {
+    void* base = mmapAligned(ARENA_SIZE, ARENA_SIZE);
+    if (!base) return false;
+    if (!mapReserve(base)) {
+      munmap(base, ARENA_SIZE);
+      return false;
+    }
+    addArena(heap, base, false);
+    return true;
+  }
+
+  //caller must hold the heap's lock. the first heap to start takes its first
+  //arena from sbrk when the program break can be aligned, every other arena
+  //comes from mmap
+  static void initializeHeap(Heap* heap) {
+      if (heap->is_initialized) return;
+      void* base = g_sbrk_claimed.exchange(true) ? NULL : sbrkArenaMemory();
+      if (base) {
+          addArena(heap, base, true);
+      } else if (!growHeap(heap)) {
+          return;
+      }
+      heap->is_initialized = true;
+      int limit = (int)(heap - g_heaps) + 1;
+      int current = g_heap_limit.load(std::memory_order_relaxed);
+      while (current < limit && !g_heap_limit.compare_exchange_weak(current, limit, std::memory_order_relaxed)) {}
+  }
+
+  //caller must hold g_global_lock
+  static void largeCacheUnlink(CachedMapping* entry) {
+    int bucket = largeCacheBucket(entry->length / PAGE_BYTES);
+    if (entry->bucket_prev) entry->bucket_prev->bucket_next = entry->bucket_next;
+    else g_large_cache[bucket] = entry->bucket_next;
+    if (entry->bucket_next) entry->bucket_next->bucket_prev = entry->bucket_prev;
+    if (entry->age_prev) entry->age_prev->age_next = entry->age_next;
+    else g_large_cache_oldest = entry->age_next;
+    if (entry->age_next) entry->age_next->age_prev = entry->age_prev;
+    else g_large_cache_newest = entry->age_prev;
+    g_large_cache_bytes -= entry->length;
+  }
+
+  //caller must hold g_global_lock. returns a cached mapping of at least length
+  //bytes, hugepage-backed or not as asked
+  static CachedMapping* largeCacheTake(size_t length, bool huge) {
+    int bucket = largeCacheBucket(length / PAGE_BYTES);
+    for (int b = bucket; b <= bucket + 1 && b < LARGE_CACHE_BUCKETS; ++b) {
+      for (CachedMapping* entry = g_large_cache[b]; entry; entry = entry->bucket_next) {
+        if (entry->length >= length && entry->huge == huge) {
+          largeCacheUnlink(entry);
+          return entry;
+        }
+      }
+    }
+    return NULL;
+  }
+
+  //caller must hold g_global_lock. unlinks entries that are too old or over the
+  //byte cap and chains them through bucket_next for the caller to unmap
+  static CachedMapping* largeCacheEvict(uint64_t now) {
+    CachedMapping* evicted = nullptr;
+    while (g_large_cache_oldest &&
+           (g_large_cache_bytes > LARGE_CACHE_MAX_BYTES || now - g_large_cache_oldest->freed_at > LARGE_CACHE_DECAY_NS)) {
+      CachedMapping* entry = g_large_cache_oldest;
+      largeCacheUnlink(entry);
+      entry->bucket_next = evicted;
+      evicted = entry;
+    }
+    return evicted;
+  }
+
+  //caller must hold g_global_lock
+  static void largeCachePut(CachedMapping* entry, size_t length, bool huge, uint64_t now) {
+    entry->length = length;
+    entry->freed_at = now;
+    entry->huge = huge;
+    int bucket = largeCacheBucket(length / PAGE_BYTES);
+    entry->bucket_prev = nullptr;
+    entry->bucket_next = g_large_cache[bucket];
+    if (entry->bucket_next) entry->bucket_next->bucket_prev = entry;
+    g_large_cache[bucket] = entry;
+    entry->age_next = nullptr;
+    entry->age_prev = g_large_cache_newest;
+    if (g_large_cache_newest) g_large_cache_newest->age_next = entry;
+    else g_large_cache_oldest = entry;
+    g_large_cache_newest = entry;
+    g_large_cache_bytes += length;
+  }
+
+  static void unmapEvicted(CachedMapping* evicted) {
+    while (evicted) {
+      CachedMapping* next = evicted->bucket_next;
+      munmap(evicted, evicted->length);
+      evicted = next;
+    }
+  }
+
+  //*zeroed, if given, is set when the payload comes straight from the kernel
+  static void* mmap_alloc(size_t size, bool* zeroed = NULL) {
+    size_t total_size = mmapLengthFor(size);
+    bool huge = g_hugepages.load(std::memory_order_relaxed) &&
+                size >= g_hugepage_min_bytes.load(std::memory_order_relaxed);
+    pthread_mutex_lock(&g_global_lock);
+    CachedMapping* cached = largeCacheTake(total_size, huge);
+    CachedMapping* evicted = largeCacheEvict(monotonicNs());
+    pthread_mutex_unlock(&g_global_lock);
+    unmapEvicted(evicted);
+
+    void* block;
+    if (zeroed) *zeroed = !cached;
+    if (cached) {
+      total_size = cached->length;
+      block = cached;
+    } else if (huge) {
+      //start on a hugepage boundary so every whole 2 MB of the block can be backed
+      block = mmapAligned(total_size, HUGE_PAGE_BYTES);
+      if (!block) return NULL;
+      madvise(block, total_size, MADV_HUGEPAGE);
+    } else {
+      block = mmap(NULL, total_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (block == MAP_FAILED) {
+        return NULL;
+      }
+    }
+    //a cached mapping was reserved when it was first made
+    if (!cached && !mapReserve(block)) {
+      munmap(block, total_size);
+      return NULL;
+    }
+    MallocMetadata* meta = (MallocMetadata*)block;
+    writeMeta(meta, total_size | META_MMAPED | (huge ? META_HUGE : 0)); //not part of buddy system
+    mapSet(block, MAP_MMAP);
+
+    pthread_mutex_lock(&g_global_lock);
+    g_mmap_block_count++;
+    pthread_mutex_unlock(&g_global_lock);
+    g_mmap_bytes.fetch_add(total_size - sizeof(MallocMetadata), std::memory_order_relaxed);
+    if (huge) g_hugepage_bytes.fetch_add(total_size, std::memory_order_relaxed);
+    notePeakTotal();
+
+    return (void*)(meta + 1);
+  }
+
+  static void mmap_free(MallocMetadata* block) {
+    mapSet(block, MAP_NONE);
+    size_t total_size = mmapLength(block);
+    bool huge = readMeta(block) & META_HUGE;
+    uint64_t now = monotonicNs();
+    bool cache = total_size <= LARGE_CACHE_MAX_ENTRY;
+    g_mmap_bytes.fetch_sub(total_size - sizeof(MallocMetadata), std::memory_order_relaxed);
+    if (huge) g_hugepage_bytes.fetch_sub(total_size, std::memory_order_relaxed);
+    pthread_mutex_lock(&g_global_lock);
+    g_mmap_block_count--;
+    if (cache) largeCachePut((CachedMapping*)block, total_size, huge, now);
+    CachedMapping* evicted = largeCacheEvict(now);
+    pthread_mutex_unlock(&g_global_lock);
+    unmapEvicted(evicted);
+    if (!cache) munmap(block, total_size);
+  }
+
+  //grows or shrinks an mmap'd block with mremap, which moves page table entries
+  //instead of copying the payload. the caller's payload starts lead bytes into
+  //the mapping. returns the new payload or NULL
+  static void* mmap_resize(MallocMetadata* block, size_t size, size_t lead) {
+    size_t old_size = mmapLength(block);
+    size_t total_size = mmapLengthFor(size);
+    if (total_size == old_size) return (void*)(block + 1);
+    size_t huge_flag = readMeta(block) & META_HUGE;
+    //the MADV_HUGEPAGE advice moves along with the mapping. a block that cannot
+    //be resized where it is moves onto a placeholder mapping that is reserved
+    //in the block map first, so the move itself cannot fail on the map
+    void* moved = mremap(block, old_size, total_size, 0);
+    if (moved == MAP_FAILED) {
+      void* target = mmap(NULL, total_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (target == MAP_FAILED) return NULL;
+      if (mapReserve(target) && mapReserve((char*)target + lead)) moved = mremap(block, old_size, total_size, MREMAP_MAYMOVE | MREMAP_FIXED, target);
+      if (moved == MAP_FAILED) {
+        munmap(target, total_size);
+        return NULL;
+      }
+      mapSet(block, MAP_NONE);
+      mapSet(moved, MAP_MMAP);
+    }
+    MallocMetadata* meta = (MallocMetadata*)moved;
+    writeMeta(meta, total_size | META_MMAPED | huge_flag);
+    g_mmap_bytes.fetch_add(total_size - old_size, std::memory_order_relaxed);
+    if (huge_flag) g_hugepage_bytes.fetch_add(total_size - old_size, std::memory_order_relaxed);
+    notePeakTotal();
+    return (void*)(meta + 1);
+  }
+
+  //the smallest order whose blocks hold size bytes past the header: the
+  //bit length of the number of whole smallest blocks below the total
+  static int orderForSize(size_t size) {
+      size_t units = (size + sizeof(MallocMetadata) - 1) >> MIN_BLOCK_SHIFT;
+      return units ? 64 - __builtin_clzll(units) : 0;
+  }
+
+  //*zeroed, if given, is set when the payload past its first two words (the
+  //free list links) is known to be zero. caller must hold the heap's lock
+  static MallocMetadata* buddyAlloc(Heap* heap, int required_order, bool* zeroed = NULL) {
+      initializeHeap(heap);
+
+      //find the smallest large enough available block
+      uint32_t usable_orders = heap->free_order_mask >> required_order;
+      if (!usable_orders) {
+        if (!heap->is_initialized || !growHeap(heap)) return NULL; //out of memory
+        usable_orders = heap->free_order_mask >> required_order;
+      }
+      int order_to_use = required_order + __builtin_ctz(usable_orders);
+
+      FreeBlock* block_to_alloc = heap->free_lists[order_to_use];
+      removeFromFreeList(heap, block_to_alloc);
+      size_t zero_flag = readMeta(&block_to_alloc->meta) & META_ZERO;
+      if (zeroed) *zeroed = zero_flag;
+      heap->used_block_count++;
+      arenaBlockAllocated(arenaOf(block_to_alloc), 1);
+
+      //challenge 1
+      int order = order_to_use;
+      while (order > required_order) {
+        order--;
+        FreeBlock* buddy = getBuddy(block_to_alloc, order);
+        setBuddyMeta(&buddy->meta, order, zero_flag);
+        addToFreeList(heap, buddy);
+      }
+
+      setBuddyMeta(&block_to_alloc->meta, required_order, 0);
+      mapSet(block_to_alloc, mapEntry(MAP_BUDDY, required_order));
+      notePeak(heap);
+      return &block_to_alloc->meta;
+  }
+
+  //frees a block made of pieces allocated blocks, more than one when
+  //sfree_batch has already merged neighbours. caller must hold the lock of
+  //the heap that owns the block
+  static void buddyFree(MallocMetadata* meta, size_t pieces = 1) {
+      Heap* heap = heapOf(meta);
+      heap->used_block_count -= pieces;
+      mapSet(meta, MAP_NONE);
+      FreeBlock* block_to_free = (FreeBlock*)meta;
+      int order = blockOrder(meta);
+      //challenge 2
+      while (order < MAX_ORDER) {
+        FreeBlock* buddy = getBuddy(block_to_free, order);
+        size_t buddy_word = readMeta(&buddy->meta);
+        if (!(buddy_word & META_FREE) || (int)(buddy_word >> META_FLAG_BITS) != order) break;
+        removeFromFreeList(heap, buddy);
+        if ((uintptr_t)buddy < (uintptr_t)block_to_free) block_to_free = buddy;
+        order++;
+      }
+
+      setBuddyMeta(&block_to_free->meta, order, 0);
+      addToFreeList(heap, block_to_free);
+      if (order == MAX_ORDER) purgeDecayed(heap, monotonicNs());
+      arenaBlockFreed(arenaOf(block_to_free), pieces);
+      notePeak(heap);
+  }
+
+  //resizes an allocated block to new_order without moving it. shrinking splits
+  //off the upper halves; growing needs every higher buddy on the way up to be
+  //free and whole, and the block to be the lower half at each step.
+  //caller must hold the lock of the heap that owns the block
+  static bool buddyResizeInPlace(MallocMetadata* meta, int new_order) {
+      Heap* heap = heapOf(meta);
+      uintptr_t addr = (uintptr_t)meta;
+      int order = blockOrder(meta);
+      if (new_order < order) {
+        while (order > new_order) {
+          order--;
+          FreeBlock* upper = (FreeBlock*)(addr + blockSize(order));
+          setBuddyMeta(&upper->meta, order, 0);
+          addToFreeList(heap, upper);
+        }
+        setBuddyMeta(meta, new_order, 0);
+        mapSet(meta, mapEntry(MAP_BUDDY, new_order));
+        notePeak(heap);
+        return true;
+      }
+
+      for (int k = order; k < new_order; ++k) {
+        if (addr & blockSize(k)) return false;
+        size_t buddy_word = readMeta(&((FreeBlock*)(addr + blockSize(k)))->meta);
+        if (!(buddy_word & META_FREE) || (int)(buddy_word >> META_FLAG_BITS) != k) return false;
+      }
+      for (int k = order; k < new_order; ++k) {
+        removeFromFreeList(heap, (FreeBlock*)(addr + blockSize(k)));
+      }
+      setBuddyMeta(meta, new_order, 0);
+      mapSet(meta, mapEntry(MAP_BUDDY, new_order));
+      notePeak(heap);
+      return true;
+  }
+
+  static void buddyRelease(void* p) {
+      buddyFree((MallocMetadata*)p - 1);
+  }
+
+  //allocates a whole order-sized block as payload, naturally aligned and with no
+  //header of its own: the block map records its order. the order-0 "carrier"
+  //block right below it keeps it from coalescing. the pair is cut from one
+  //block of the next order up, the rest of its lower half goes back to the free
+  //lists. the payload's first word, where its header would be, is never read
+  //while the carrier is allocated: the only block that has it as a buddy is the
+  //whole lower half. caller must hold the heap's lock
+  static void* buddyAllocCarried(Heap* heap, int order) {
+      MallocMetadata* meta = buddyAlloc(heap, order + 1);
+      if (!meta) return NULL;
+      mapSet(meta, MAP_NONE);
+      uintptr_t addr = (uintptr_t)meta;
+      for (int k = order - 1; k >= 0; --k) {
+        FreeBlock* lower = (FreeBlock*)addr;
+        setBuddyMeta(&lower->meta, k, 0);
+        addToFreeList(heap, lower);
+        addr += blockSize(k);
+      }
+      MallocMetadata* carrier = (MallocMetadata*)addr;
+      setBuddyMeta(carrier, 0, 0);
+      heap->used_block_count++;
+      arenaBlockAllocated(arenaOf(carrier), 1);
+      void* payload = (void*)(addr + MIN_BLOCK_SIZE_BYTES);
+      mapSet(payload, mapEntry(MAP_CARRIED, order));
+      return payload;
+  }
+
+  //caller must hold the lock of the heap that owns the block
+  static void buddyFreeCarried(void* p, int order) {
+      MallocMetadata* meta = (MallocMetadata*)p;
+      setBuddyMeta(meta, order, 0);
+      buddyFree(meta);
+      buddyFree((MallocMetadata*)((uintptr_t)p - MIN_BLOCK_SIZE_BYTES));
+  }
+
+  //slab layer. a slab is a regular order-SLAB_ORDER buddy block whose units are
+  //all MAP_SLAB in the block map with its size class, so the class of an object
+  //comes from the unit it lies in and its slab from rounding down to SLAB_SIZE.
+  static int slabObjectCount(int size_class) {
+      return (int)((SLAB_SIZE - SLAB_OBJECTS_OFFSET) / slabObjectSize(size_class));
+  }
+
+  static int slabClassOf(uint8_t entry) {
+      return mapValue(entry);
+  }
+
+  //returns the slab holding p, or NULL if p is not a slab object
+  static Slab* slabOf(void* p) {
+      if (mapKind(mapLookup(p)) != MAP_SLAB) return NULL;
+      return (Slab*)((MallocMetadata*)((uintptr_t)p & ~(uintptr_t)(SLAB_SIZE - 1)) + 1);
+  }
+
+  //enters or clears every unit of a slab block
+  static void mapSetSlab(MallocMetadata* meta, int size_class, bool live) {
+      for (size_t i = 0; i < SLAB_SIZE / MIN_BLOCK_SIZE_BYTES; ++i) {
+        mapSet((char*)meta + i * MIN_BLOCK_SIZE_BYTES, live ? mapEntry(MAP_SLAB, size_class) : MAP_NONE);
+      }
+  }
+
+  static char* slabObjects(Slab* slab) {
+      return (char*)slab - sizeof(MallocMetadata) + SLAB_OBJECTS_OFFSET;
+  }
+
+  static void slabListRemove(Heap* heap, Slab* slab) {
+      if (slab->prev) slab->prev->next = slab->next;
+      else heap->partial_slabs[slab->size_class] = slab->next;
+      if (slab->next) slab->next->prev = slab->prev;
+      slab->next = nullptr;
+      slab->prev = nullptr;
+  }
+
+  static void slabListPush(Heap* heap, Slab* slab) {
+      slab->prev = nullptr;
+      slab->next = heap->partial_slabs[slab->size_class];
+      if (slab->next) slab->next->prev = slab;
+      heap->partial_slabs[slab->size_class] = slab;
+  }
+
+  //caller must hold the heap's lock
+  static void* slabAlloc(Heap* heap, int size_class) {
+      Slab* slab = heap->partial_slabs[size_class];
+      if (!slab) {
+          MallocMetadata* meta = buddyAlloc(heap, SLAB_ORDER);
+          if (!meta) return NULL;
+          mapSetSlab(meta, size_class, true);
+          heap->slab_count++;
+          slab = (Slab*)(meta + 1);
+          slab->size_class = size_class;
+          slab->object_count = slabObjectCount(size_class);
+          slab->free_mask = slab->object_count == 64 ? ~(uint64_t)0 : (((uint64_t)1 << slab->object_count) - 1);
+          slabListPush(heap, slab);
+      }
+      int index = __builtin_ctzll(slab->free_mask);
+      slab->free_mask &= slab->free_mask - 1;
+      if (!slab->free_mask) slabListRemove(heap, slab);
+      return slabObjects(slab) + index * slabObjectSize(size_class);
+  }
+
+  //caller must hold the lock of the heap that owns the slab
+  static void slabFree(void* p) {
+      Slab* slab = slabOf(p);
+      Heap* heap = heapOf(slab);
+      size_t index = ((char*)p - slabObjects(slab)) / slabObjectSize(slab->size_class);
+      bool was_full = !slab->free_mask;
+      slab->free_mask |= (uint64_t)1 << index;
+      if (was_full) slabListPush(heap, slab);
+      if (__builtin_popcountll(slab->free_mask) < slab->object_count) return;
+
+      //keep one empty slab per class around so a lone object does not split and merge every time
+      if (heap->partial_slabs[slab->size_class] == slab && !slab->next) return;
+      slabListRemove(heap, slab);
+      MallocMetadata* meta = (MallocMetadata*)slab - 1;
+      mapSetSlab(meta, slab->size_class, false);
+      heap->slab_count--;
+      buddyFree(meta);
+  }
+
+  //remote free queues. a block freed on a CPU other than its heap's is pushed
+  //onto the heap's remote_frees stack with one CAS instead of taking the heap
+  //lock. the owner takes the whole stack at once, so a push never races with
+  //a pop of a single node and the stack has no ABA problem.
+  static bool isRemote(Heap* heap) {
+    return g_remote_frees.load(std::memory_order_relaxed) && heap != localHeap();
+  }
+
+  //pushes the chain first..last, already linked through first words
+  static void remoteFreePush(Heap* heap, void* first, void* last) {
+    void* head = heap->remote_frees.load(std::memory_order_relaxed);
+    do {
+      *(void**)last = head;
+    } while (!heap->remote_frees.compare_exchange_weak(head, first, std::memory_order_release,
+                                                        std::memory_order_relaxed));
+  }
+
+  //returns a payload of any kind to the free lists. caller must hold the lock
+  //of the heap that owns it
+  static void heapRelease(void* p) {
+    uint8_t entry = mapLookup(p);
+    if (mapKind(entry) == MAP_SLAB) slabFree(p);
+    else if (mapKind(entry) == MAP_CARRIED) buddyFreeCarried(p, mapValue(entry));
+    else buddyFree((MallocMetadata*)p - 1);
+  }
+
+  //caller must hold the heap's lock
+  static void drainRemoteFrees(Heap* heap) {
+    if (!heap->remote_frees.load(std::memory_order_relaxed)) return;
+    void* p = heap->remote_frees.exchange(NULL, std::memory_order_acquire);
+    while (p) {
+      void* next = *(void**)p;
+      heapRelease(p);
+      p = next;
+    }
+  }
+
+  //thread cache. cached blocks stay marked as used in the central heap, so
+  //coalescing never touches them until they are flushed back.
+  static size_t tcacheLimit(int order) {
+    size_t limit = TCACHE_BIN_BYTES / (MIN_BLOCK_SIZE_BYTES << order);
+    return limit < 2 ? 2 : limit;
+  }
+
+  static size_t tcacheSlabLimit(int size_class) {
+    return 2 * slabObjectCount(size_class);
+  }
+
+  //returns blocks to their heaps until at most keep are left in the bin. in
+  //remote free mode, runs of blocks of another CPU's heap are chained up and
+  //queued for it with a single push
+  static void tcacheFlush(TCacheBin* bin, size_t keep, void (*release)(void*)) {
+    Heap* local = g_remote_frees.load(std::memory_order_relaxed) ? localHeap() : NULL;
+    Heap* locked = NULL;
+    Heap* chain_heap = NULL;
+    void* chain_first = NULL;
+    void* chain_last = NULL;
+    while (bin->count.load(std::memory_order_relaxed) > keep) {
+      void* p = tcachePop(bin);
+      Heap* heap = heapOf(p);
+      if (local && heap != local) {
+        if (chain_heap != heap) {
+          if (chain_heap) remoteFreePush(chain_heap, chain_first, chain_last);
+          chain_heap = heap;
+          chain_last = p;
+          *(void**)p = NULL;
+        } else {
+          *(void**)p = chain_first;
+        }
+        chain_first = p;
+        continue;
+      }
+      switchHeap(&locked, heap);
+      release(p);
+    }
+    switchHeap(&locked, NULL);
+    if (chain_heap) remoteFreePush(chain_heap, chain_first, chain_last);
+  }
+
+  static void tcacheFlushAll(TCache* cache) {
+    for (int i = 0; i <= TCACHE_MAX_ORDER; ++i) {
+      tcacheFlush(&cache->bins[i], 0, buddyRelease);
+    }
+    for (int i = 0; i < SLAB_CLASS_COUNT; ++i) {
+      tcacheFlush(&cache->slab_bins[i], 0, slabFree);
+    }
+  }
+
+  static void tcacheDestroy(void* arg) {
+    TCache* cache = (TCache*)arg;
+    tcacheFlushAll(cache);
+    pthread_mutex_lock(&g_global_lock);
+    if (cache->prev) cache->prev->next = cache->next;
+    if (cache->next) cache->next->prev = cache->prev;
+    if (g_tcache_list == cache) g_tcache_list = cache->next;
+    pthread_mutex_unlock(&g_global_lock);
+    cache->registered = false;
+  }
+
+  //every lock is held across fork so the child gets consistent heaps. only
+  //the forking thread lives on in the child: the other caches are dropped from
+  //the list, and the blocks they held are lost to the child.
+  static void forkPrepare() {
+    for (int i = 0; i < MAX_HEAPS; ++i) pthread_mutex_lock(&g_heaps[i].lock);
+    pthread_mutex_lock(&g_global_lock);
+  }
+
+  static void forkParent() {
+    pthread_mutex_unlock(&g_global_lock);
+    for (int i = MAX_HEAPS - 1; i >= 0; --i) pthread_mutex_unlock(&g_heaps[i].lock);
+  }
+
+  static void forkChild() {
+    for (int i = 0; i < MAX_HEAPS; ++i) pthread_mutex_init(&g_heaps[i].lock, NULL);
+    pthread_mutex_init(&g_global_lock, NULL);
+    //the purge thread does not exist in the child
+    pthread_mutex_init(&g_purge_config_lock, NULL);
+    pthread_mutex_init(&g_purge_lock, NULL);
+    pthread_cond_init(&g_purge_wake, NULL);
+    g_purge_thread_running = false;
+    g_tcache_list = nullptr;
+    if (t_cache.registered) {
+      t_cache.next = nullptr;
+      t_cache.prev = nullptr;
+      g_tcache_list = &t_cache;
+    }
+  }
+
+  static void registerProcessHooks() {
+    pthread_key_create(&g_tcache_key, tcacheDestroy);
+    pthread_atfork(forkPrepare, forkParent, forkChild);
+  }
+
+  //makes the cache visible to the stats functions and flushes it on thread exit.
+  //the cache is usable before the libc calls below, which may allocate
+  static void tcacheRegister(TCache* cache) {
+    cache->registered = true;
+    pthread_mutex_lock(&g_global_lock);
+    cache->prev = nullptr;
+    cache->next = g_tcache_list;
+    if (g_tcache_list) g_tcache_list->prev = cache;
+    g_tcache_list = cache;
+    pthread_mutex_unlock(&g_global_lock);
+    pthread_once(&g_process_hooks_once, registerProcessHooks);
+    pthread_setspecific(g_tcache_key, cache);
+  }
+
+  //takes half a bin worth of blocks from the local heap in one locked pass
+  static void* tcacheRefill(TCacheBin* bin, int order) {
+    size_t batch = tcacheLimit(order) / 2;
+    Heap* heap = lockLocalHeap();
+    MallocMetadata* block = buddyAlloc(heap, order);
+    for (size_t i = 1; block && i < batch; ++i) {
+      MallocMetadata* extra = buddyAlloc(heap, order);
+      if (!extra) break;
+      tcachePush(bin, (void*)(extra + 1));
+    }
+    pthread_mutex_unlock(&heap->lock);
+    return block ? (void*)(block + 1) : NULL;
+  }
+
+  static void* tcacheRefillSlab(TCacheBin* bin, int size_class) {
+    size_t batch = tcacheSlabLimit(size_class) / 2;
+    Heap* heap = lockLocalHeap();
+    void* object = slabAlloc(heap, size_class);
+    for (size_t i = 1; object && i < batch; ++i) {
+      void* extra = slabAlloc(heap, size_class);
+      if (!extra) break;
+      tcachePush(bin, extra);
+    }
+    pthread_mutex_unlock(&heap->lock);
+    return object;
+  }
+
+  static void* smalloc(size_t size) {
+      if(size == 0 || size > MAX_ALLOC) {
+          return NULL;
+      }
+
+      //challenge 3
+      if (size + sizeof(MallocMetadata) >= MMAP_THRESHOLD) {
+        return mmap_alloc(size);
+      }
+
+      if (!t_cache.registered) tcacheRegister(&t_cache);
+      if (size <= SLAB_MAX_OBJECT) {
+        int size_class = slabClassForSize(size);
+        TCacheBin* bin = &t_cache.slab_bins[size_class];
+        void* p = tcachePop(bin);
+        if (p) return p;
+        p = tcacheRefillSlab(bin, size_class);
+        if (p) return p;
+        tcacheFlushAll(&t_cache);
+        Heap* heap = lockLocalHeap();
+        p = slabAlloc(heap, size_class);
+        pthread_mutex_unlock(&heap->lock);
+        return p;
+      }
+
+      //challenge 0
+      int required_order = orderForSize(size);
+      if (required_order > MAX_ORDER) return NULL;
+
+      if (required_order <= TCACHE_MAX_ORDER) {
+        TCacheBin* bin = &t_cache.bins[required_order];
+        void* p = tcachePop(bin);
+        if (p) return p;
+        p = tcacheRefill(bin, required_order);
+        if (p) return p;
+      } else {
+        Heap* heap = lockLocalHeap();
+        MallocMetadata* block = buddyAlloc(heap, required_order);
+        pthread_mutex_unlock(&heap->lock);
+        if (block) return (void*)(block + 1);
+      }
+
+      //out of memory - give back what this thread has cached and retry once
+      tcacheFlushAll(&t_cache);
+      Heap* heap = lockLocalHeap();
+      MallocMetadata* block = buddyAlloc(heap, required_order);
+      pthread_mutex_unlock(&heap->lock);
+      return block ? (void*)(block + 1) : NULL;
+  }
+
+  static void* scalloc(size_t num, size_t size){
+      if (num == 0 || size == 0) {
+          return NULL;
+      }
+      if (num > 0 && size > MAX_ALLOC / num) {
+          return NULL;
+      }
+      size_t total_size = num * size;
+
+      //fresh mappings and never-used arena blocks are already zero. blocks up to
+      //the thread cache orders are cheap to clear and come from the cache
+      bool zeroed = false;
+      void* ret = NULL;
+      if (total_size + sizeof(MallocMetadata) >= MMAP_THRESHOLD) {
+          ret = mmap_alloc(total_size, &zeroed);
+      } else if (total_size > SLAB_MAX_OBJECT && orderForSize(total_size) > TCACHE_MAX_ORDER) {
+          Heap* heap = lockLocalHeap();
+          MallocMetadata* block = buddyAlloc(heap, orderForSize(total_size), &zeroed);
+          pthread_mutex_unlock(&heap->lock);
+          if (block) {
+              ret = (void*)(block + 1);
+              if (zeroed) std::memset(ret, 0, sizeof(FreeBlock) - sizeof(MallocMetadata));
+          }
+      }
+      if (!ret) {
+          ret = smalloc(total_size);
+          zeroed = false;
+      }
+      if(ret != NULL && !zeroed) {
+          std::memset(ret, 0, total_size);
+      }
+      return ret;
+  }
+
+  //aligned allocation. alignments of a block size or more are served by a
+  //carried buddy block, wasting only the carrier. smaller ones, and payloads too
+  //big for a buddy block, are allocated alignment bytes larger and the payload is
+  //moved up to the first aligned address past a META_ALIGNED word. a payload
+  //that lands in another unit than its block's payload is entered in the block
+  //map as MAP_ALIGNED; a large mapping may take it into a chunk of its own.
+  static void* smemalign(size_t alignment, size_t size) {
+      if (!alignment || (alignment & (alignment - 1))) return NULL;
+      if (alignment <= sizeof(MallocMetadata)) return smalloc(size);
+      //slab objects are SLAB_CLASS_STEP-aligned
+      if (alignment <= SLAB_CLASS_STEP && size <= SLAB_MAX_OBJECT) return smalloc(size);
+      if (size == 0 || size > MAX_ALLOC) return NULL;
+
+      if (alignment >= MIN_BLOCK_SIZE_BYTES) {
+        int order = 0;
+        while (order < MAX_ORDER && (blockSize(order) < size || blockSize(order) < alignment)) order++;
+        if (order < MAX_ORDER) {
+          Heap* heap = lockLocalHeap();
+          void* p = buddyAllocCarried(heap, order);
+          pthread_mutex_unlock(&heap->lock);
+          return p;
+        }
+      }
+
+      //blocks are allocated with their payload 8 bytes past a 16-byte boundary,
+      //so the first aligned address past the extra word is at most alignment - 8 further
+      size_t padded = size + alignment;
+      if (padded <= SLAB_MAX_OBJECT) padded = SLAB_MAX_OBJECT + 1;
+      void* p = smalloc(padded);
+      if (!p) return NULL;
+      MallocMetadata* meta = (MallocMetadata*)p - 1;
+      uintptr_t aligned_addr = ((uintptr_t)p + sizeof(MallocMetadata) + alignment - 1) & ~(uintptr_t)(alignment - 1);
+      size_t offset = aligned_addr - (uintptr_t)meta;
+      if (offset >= MIN_BLOCK_SIZE_BYTES) {
+          if (!mapReserve((void*)aligned_addr)) {
+              sfree(p);
+              return NULL;
+          }
+          mapSet((void*)aligned_addr, MAP_ALIGNED);
+      }
+      writeMeta((MallocMetadata*)aligned_addr - 1, (offset << META_FLAG_BITS) | META_ALIGNED);
+      return (void*)aligned_addr;
+  }
+
+  static void* saligned_alloc(size_t alignment, size_t size) {
+      if (!alignment || size % alignment) return NULL;
+      return smemalign(alignment, size);
+  }
+
+  //header of the buddy or mmap'd block holding payload p
+  static MallocMetadata* blockOf(void* p) {
+      MallocMetadata* meta = (MallocMetadata*)p - 1;
+      size_t word = readMeta(meta);
+      if (word & META_ALIGNED) meta = (MallocMetadata*)((uintptr_t)p - (word >> META_FLAG_BITS));
+      return meta;
+  }
+
+  //0 for a pointer the allocator did not hand out
+  static size_t usableSize(void* p) {
+      uint8_t entry = mapLookup(p);
+      uint8_t kind = mapKind(entry);
+      if (kind == MAP_NONE) return 0;
+      if (kind == MAP_SLAB) return slabObjectSize(slabClassOf(entry));
+      if (kind == MAP_CARRIED) return blockSize(mapValue(entry));
+      if (kind == MAP_BUDDY && atPayloadStart(p)) return blockSize(mapValue(entry)) - sizeof(MallocMetadata);
+      MallocMetadata* meta = blockOf(p);
+      size_t total = isMmaped(meta) ? mmapLength(meta) : blockSize(blockOrder(meta));
+      return total - ((uintptr_t)p - (uintptr_t)meta);
+  }
+
+  //puts a freed slab object or buddy payload into the calling thread's cache,
+  //flushing half of the bin once it is over its limit
+  static void cacheSlabObject(void* p, int size_class) {
+      TCacheBin* bin = &t_cache.slab_bins[size_class];
+      tcachePush(bin, p);
+      if (bin->count.load(std::memory_order_relaxed) > tcacheSlabLimit(size_class)) {
+        tcacheFlush(bin, tcacheSlabLimit(size_class) / 2, slabFree);
+      }
+  }
+
+  static void cacheBuddyBlock(void* p, int order) {
+      TCacheBin* bin = &t_cache.bins[order];
+      tcachePush(bin, p);
+      if (bin->count.load(std::memory_order_relaxed) > tcacheLimit(order)) {
+        tcacheFlush(bin, tcacheLimit(order) / 2, buddyRelease);
+      }
+  }
+
+  //everything but an over-aligned payload is freed from its block map entry
+  //alone. pointers with no entry were not handed out here and are ignored
+  static void sfree(void* p) {
+      if (!p) return;
+      uint8_t entry = mapLookup(p);
+      uint8_t kind = mapKind(entry);
+      if (kind == MAP_NONE) return;
+      if (!t_cache.registered) tcacheRegister(&t_cache);
+      if (kind == MAP_SLAB) {
+        cacheSlabObject(p, slabClassOf(entry));
+        return;
+      }
+      if (kind == MAP_CARRIED) {
+        Heap* heap = heapOf(p);
+        if (isRemote(heap)) {
+          remoteFreePush(heap, p, p);
+          return;
+        }
+        pthread_mutex_lock(&heap->lock);
+        buddyFreeCarried(p, mapValue(entry));
+        pthread_mutex_unlock(&heap->lock);
+        return;
+      }
+      if (kind == MAP_ALIGNED || !atPayloadStart(p)) {
+        //an over-aligned payload goes back as the block it was cut from
+        if (kind == MAP_ALIGNED) mapSet(p, MAP_NONE);
+        p = (void*)(blockOf(p) + 1);
+        entry = mapLookup(p);
+        kind = mapKind(entry);
+      }
+      MallocMetadata* block_to_free = (MallocMetadata*)p - 1;
+
+      //challenge 3
+      if (kind == MAP_MMAP) {
+        mmap_free(block_to_free);
+        return;
+      }
+
+      int order = mapValue(entry);
+      if (order <= TCACHE_MAX_ORDER) {
+        cacheBuddyBlock(p, order);
+        return;
+      }
+
+      Heap* heap = heapOf(block_to_free);
+      if (isRemote(heap)) {
+        remoteFreePush(heap, p, p);
+        return;
+      }
+      pthread_mutex_lock(&heap->lock);
+      buddyFree(block_to_free);
+      pthread_mutex_unlock(&heap->lock);
+  }
+
+  //size picks the slab class or buddy order smalloc used for it, so a cached
+  //free never reads the slab or block header: neither is brought into the cache
+  static void sfree_sized(void* p, size_t size) {
+      if (!p) return;
+      if (size == 0 || size > MAX_ALLOC || size + sizeof(MallocMetadata) >= MMAP_THRESHOLD) {
+        //a mapping's length is only in its header
+        sfree(p);
+        return;
+      }
+      if (!t_cache.registered) tcacheRegister(&t_cache);
+      if (size <= SLAB_MAX_OBJECT) {
+        cacheSlabObject(p, slabClassForSize(size));
+        return;
+      }
+      int order = orderForSize(size);
+      if (order <= TCACHE_MAX_ORDER) {
+        cacheBuddyBlock(p, order);
+        return;
+      }
+      sfree(p);
+  }
+
+  static size_t smalloc_usable_size(void* p) {
+      return p ? usableSize(p) : 0;
+  }
+
+  //srealloc that moves the payload to an alignment-aligned address when it has
+  //to copy. resizing in place, or with mremap, keeps the address modulo a page.
+  static void* reallocAligned(void* p, size_t size, size_t alignment) {
+      if(p == NULL) {
+          return smemalign(alignment, size);
+      }
+      if (size == 0 || size > MAX_ALLOC) return NULL;
+
+      //a block stays what smalloc would make for its new size: a slab object of
+      //that class, a buddy block or a mapping. sfree_sized relies on it, so a
+      //block that would change kind is moved even when it is large enough
+      uint8_t entry = mapLookup(p);
+      uint8_t kind = mapKind(entry);
+      if (kind == MAP_NONE) return NULL;
+      bool same_kind = kind == MAP_SLAB ? size <= SLAB_MAX_OBJECT && slabClassForSize(size) == slabClassOf(entry)
+                                        : kind == MAP_CARRIED; //aligned blocks are not freed by size
+      if (kind == MAP_BUDDY || kind == MAP_MMAP || kind == MAP_ALIGNED) {
+          bool plain = kind != MAP_ALIGNED && atPayloadStart(p);
+          MallocMetadata* old_meta = plain ? (MallocMetadata*)p - 1 : blockOf(p);
+          size_t lead = (uintptr_t)p - (uintptr_t)old_meta;
+          bool mmaped = plain ? kind == MAP_MMAP : isMmaped(old_meta);
+          if (!plain) same_kind = true;
+          if (mmaped && size + lead >= MMAP_THRESHOLD) {
+              void* moved = mmap_resize(old_meta, size + lead - sizeof(MallocMetadata), lead);
+              if (!moved) return NULL;
+              void* new_p = (void*)((char*)moved - sizeof(MallocMetadata) + lead);
+              if (kind == MAP_ALIGNED && new_p != p) {
+                  mapSet(p, MAP_NONE);
+                  mapSet(new_p, MAP_ALIGNED);
+              }
+              return new_p;
+          }
+          if (!mmaped && size + lead < MMAP_THRESHOLD && (same_kind || size > SLAB_MAX_OBJECT)) {
+              int old_order = plain ? mapValue(entry) : blockOrder(old_meta);
+              int new_order = orderForSize(size + lead - sizeof(MallocMetadata));
+              if (new_order == old_order) return p;
+              Heap* heap = heapOf(old_meta);
+              pthread_mutex_lock(&heap->lock);
+              bool resized = buddyResizeInPlace(old_meta, new_order);
+              pthread_mutex_unlock(&heap->lock);
+              if (resized && new_order > old_order) g_realloc_copies_avoided.fetch_add(1, std::memory_order_relaxed);
+              if (resized) return p;
+          }
+      }
+      size_t user_space = usableSize(p);
+      if (size <= user_space && same_kind) {
+          return p;
+      }
+
+      void* new_p = smemalign(alignment, size);
+      if (!new_p) return NULL;
+      std::memmove(new_p, p, size < user_space ? size : user_space);
+      sfree(p);
+      return new_p;
+  }
+
+  static void* srealloc(void* p, size_t size) {
+      return reallocAligned(p, size, sizeof(MallocMetadata));
+  }
+
+  //carves count order-sized blocks out of as few free blocks as possible: a
+  //block big enough for the rest of the batch if there is one, else the
+  //largest there is. the carved block is split once into pieces, and what
+  //the batch does not need goes back as the largest aligned blocks that fit.
+  //caller must hold the heap's lock
+  static size_t buddyAllocBatch(Heap* heap, int order, size_t count, void** out) {
+      initializeHeap(heap);
+      size_t n = 0;
+      while (n < count) {
+        if (!(heap->free_order_mask >> order)) {
+          if (!heap->is_initialized || !growHeap(heap)) break; //out of memory
+        }
+        int wanted = order;
+        while (wanted < MAX_ORDER && ((size_t)1 << (wanted - order)) < count - n) wanted++;
+        uint32_t covering = heap->free_order_mask >> wanted;
+        int source = covering ? wanted + __builtin_ctz(covering) : 31 - __builtin_clz(heap->free_order_mask);
+        int carved = covering ? wanted : source;
+
+        FreeBlock* block = heap->free_lists[source];
+        removeFromFreeList(heap, block);
+        size_t zero_flag = readMeta(&block->meta) & META_ZERO;
+        uintptr_t addr = (uintptr_t)block;
+        for (int k = source; k > carved; ) {
+          k--;
+          FreeBlock* upper = (FreeBlock*)(addr + blockSize(k));
+          setBuddyMeta(&upper->meta, k, zero_flag);
+          addToFreeList(heap, upper);
+        }
+
+        size_t pieces = std::min(count - n, (size_t)1 << (carved - order));
+        for (size_t i = 0; i < pieces; ++i) {
+          MallocMetadata* meta = (MallocMetadata*)(addr + i * blockSize(order));
+          setBuddyMeta(meta, order, 0);
+          mapSet(meta, mapEntry(MAP_BUDDY, order));
+          out[n++] = (void*)(meta + 1);
+        }
+        uintptr_t end = addr + blockSize(carved);
+        uintptr_t tail = addr + pieces * blockSize(order);
+        while (tail < end) {
+          int k = order;
+          while (k + 1 < carved && !(tail & (blockSize(k + 1) - 1)) && tail + blockSize(k + 1) <= end) k++;
+          FreeBlock* rest = (FreeBlock*)tail;
+          setBuddyMeta(&rest->meta, k, zero_flag);
+          addToFreeList(heap, rest);
+          tail += blockSize(k);
+        }
+        heap->used_block_count += pieces;
+        arenaBlockAllocated(arenaOf(block), pieces);
+      }
+      notePeak(heap);
+      return n;
+  }
+
+  static size_t smalloc_batch(size_t size, size_t count, void** out_ptrs) {
+      if (size == 0 || size > MAX_ALLOC) return 0;
+      size_t n = 0;
+      if (size + sizeof(MallocMetadata) >= MMAP_THRESHOLD) {
+        while (n < count && (out_ptrs[n] = mmap_alloc(size))) n++;
+        return n;
+      }
+
+      if (!t_cache.registered) tcacheRegister(&t_cache);
+      if (size <= SLAB_MAX_OBJECT) {
+        int size_class = slabClassForSize(size);
+        TCacheBin* bin = &t_cache.slab_bins[size_class];
+        while (n < count && (out_ptrs[n] = tcachePop(bin))) n++;
+        Heap* heap = lockLocalHeap();
+        while (n < count && (out_ptrs[n] = slabAlloc(heap, size_class))) n++;
+        pthread_mutex_unlock(&heap->lock);
+        return n;
+      }
+
+      int order = orderForSize(size);
+      if (order <= TCACHE_MAX_ORDER) {
+        TCacheBin* bin = &t_cache.bins[order];
+        while (n < count && (out_ptrs[n] = tcachePop(bin))) n++;
+      }
+      Heap* heap = lockLocalHeap();
+      n += buddyAllocBatch(heap, order, count - n, out_ptrs + n);
+      pthread_mutex_unlock(&heap->lock);
+      return n;
+  }
+
+  //plain buddy blocks are merged with each other on a stack first, all under
+  //one lock: a block waits there for its upper buddy, so a run of pieces from
+  //smalloc_batch, which come out in address order, collapses back into the
+  //block it was carved from before the free lists are touched. blocks given in
+  //any other order are still merged, by buddyFree. slab objects go straight
+  //back to their slabs, everything else takes the sfree path. the lock of a
+  //block's heap is taken when the block before it belongs to another one.
+  static void sfree_batch(void** ptrs, size_t count) {
+
+      struct Pending {
+        uintptr_t addr;
+        int order;
+        size_t pieces;
+      };
+      Pending stack[MAX_ORDER + 1];
+      int depth = 0;
+      Heap* locked = NULL;
+      for (size_t i = 0; i <= count; ++i) {
+        Pending block = {0, 0, 0};
+        Heap* heap = NULL;
+        if (i < count) {
+          void* p = ptrs[i];
+          if (!p) continue;
+          uint8_t entry = mapLookup(p);
+          bool slab = mapKind(entry) == MAP_SLAB;
+          bool plain = mapKind(entry) == MAP_BUDDY && atPayloadStart(p);
+          if (slab || plain) heap = heapOf(p);
+          if (slab && heap == locked) {
+            slabFree(p);
+            continue;
+          }
+          if (plain && heap == locked) {
+            //the block may be merged into a lower one before it reaches buddyFree
+            MallocMetadata* meta = (MallocMetadata*)p - 1;
+            mapSet(meta, MAP_NONE);
+            block = {(uintptr_t)meta, mapValue(entry), 1};
+            while (depth > 0 && stack[depth - 1].order == block.order &&
+                   (stack[depth - 1].addr ^ blockSize(block.order)) == block.addr) {
+              Pending lower = stack[--depth];
+              block = {lower.addr, block.order + 1, lower.pieces + block.pieces};
+            }
+          }
+        }
+        //the stack only waits while this block continues it, as an upper neighbour
+        //that may still grow into the buddy of the top entry
+        bool continues = block.pieces && block.order < MAX_ORDER && !(block.addr & blockSize(block.order)) &&
+                         (depth == 0 || stack[depth - 1].addr + blockSize(stack[depth - 1].order) == block.addr);
+        if (!continues) {
+          while (depth > 0) {
+            Pending done = stack[--depth];
+            setBuddyMeta((MallocMetadata*)done.addr, done.order, 0);
+            buddyFree((MallocMetadata*)done.addr, done.pieces);
+          }
+          if (block.pieces) {
+            setBuddyMeta((MallocMetadata*)block.addr, block.order, 0);
+            buddyFree((MallocMetadata*)block.addr, block.pieces);
+          } else if (i < count) {
+            //the stack is empty now, so the lock may move: retry this pointer
+            //under its own heap's lock, or without one for the sfree path
+            switchHeap(&locked, heap);
+            if (heap) --i;
+            else sfree(ptrs[i]);
+          }
+          continue;
+        }
+        stack[depth++] = block;
+      }
+      switchHeap(&locked, NULL);
+  }
+
+
+  //the stats functions read counters kept up to date on every split, merge,
+  //alloc and free. the heaps are summed one lock at a time, after taking in
+  //their remote frees, so a total is not one snapshot while other threads run.
+  //thread cache bins are not shared counters, so cached blocks cost one pass
+  //over the live threads under g_global_lock; counts read from other threads'
+  //caches may be slightly stale.
+  struct HeapTotals {
+      size_t free_counts[MAX_ORDER + 1];
+      size_t free_list_bytes;
+      uint32_t free_order_mask; //bit i set = some heap has a free block of order i
+      size_t used_block_count;
+      size_t arena_count;
+      size_t slab_count;
+      size_t in_use_bytes;
+      size_t zero_bytes;
+  };
+
+  static void sumHeaps(HeapTotals* totals) {
+      std::memset(totals, 0, sizeof(*totals));
+      int limit = g_heap_limit.load(std::memory_order_relaxed);
+      for (int h = 0; h < limit; ++h) {
+          Heap* heap = &g_heaps[h];
+          pthread_mutex_lock(&heap->lock);
+          drainRemoteFrees(heap);
+          for (int i = 0; i <= MAX_ORDER; ++i) totals->free_counts[i] += heap->free_counts[i];
+          totals->free_list_bytes += heap->free_list_bytes;
+          totals->free_order_mask |= heap->free_order_mask;
+          totals->used_block_count += heap->used_block_count;
+          totals->arena_count += heap->arena_count;
+          totals->slab_count += heap->slab_count;
+          totals->in_use_bytes += heap->arena_count * ARENA_SIZE - heap->free_list_bytes;
+          totals->zero_bytes += heap->zero_bytes;
+          pthread_mutex_unlock(&heap->lock);
+      }
+  }
+
+  //caller must hold g_global_lock
+  static void cachedCounts(size_t* counts) {
+      for (int i = 0; i <= TCACHE_MAX_ORDER; ++i) counts[i] = 0;
+      for (TCache* cache = g_tcache_list; cache; cache = cache->next) {
+          for (int i = 0; i <= TCACHE_MAX_ORDER; ++i) {
+              counts[i] += cache->bins[i].count.load(std::memory_order_relaxed);
+          }
+      }
+  }
+
+  static size_t cachedBlocks() {
+      size_t counts[TCACHE_MAX_ORDER + 1];
+      pthread_mutex_lock(&g_global_lock);
+      cachedCounts(counts);
+      pthread_mutex_unlock(&g_global_lock);
+      size_t count = 0;
+      for (int i = 0; i <= TCACHE_MAX_ORDER; ++i) count += counts[i];
+      return count;
+  }
+
+  static size_t cachedBytes() {
+      size_t counts[TCACHE_MAX_ORDER + 1];
+      pthread_mutex_lock(&g_global_lock);
+      cachedCounts(counts);
+      pthread_mutex_unlock(&g_global_lock);
+      size_t total_bytes = 0;
+      for (int i = 0; i <= TCACHE_MAX_ORDER; ++i) {
+          total_bytes += counts[i] * (blockSize(i) - sizeof(MallocMetadata));
+      }
+      return total_bytes;
+  }
+
+  static size_t freeListBlocks(const HeapTotals* totals) {
+      size_t count = 0;
+      for (int i = 0; i <= MAX_ORDER; ++i) {
+          count += totals->free_counts[i];
+      }
+      return count;
+  }
+
+  static size_t freeListBytes(const HeapTotals* totals) {
+      return totals->free_list_bytes - freeListBlocks(totals) * sizeof(MallocMetadata);
+  }
+
+  static size_t mmapBlockCount() {
+      pthread_mutex_lock(&g_global_lock);
+      size_t count = g_mmap_block_count;
+      pthread_mutex_unlock(&g_global_lock);
+      return count;
+  }
+
+  static size_t _num_free_blocks() {
+      HeapTotals totals;
+      sumHeaps(&totals);
+      return freeListBlocks(&totals) + cachedBlocks();
+  }
+
+  static size_t _num_free_bytes() {
+      HeapTotals totals;
+      sumHeaps(&totals);
+      return freeListBytes(&totals) + cachedBytes();
+  }
+
+  static size_t allocatedBlocks(const HeapTotals* totals) {
+      //cached blocks are already part of used_block_count
+      return freeListBlocks(totals) + totals->used_block_count + mmapBlockCount();
+  }
+
+  static size_t _num_allocated_blocks() {
+      HeapTotals totals;
+      sumHeaps(&totals);
+      return allocatedBlocks(&totals);
+  }
+
+  static size_t _num_allocated_bytes() {
+      HeapTotals totals;
+      sumHeaps(&totals);
+      size_t total_buddy_blocks = freeListBlocks(&totals) + totals.used_block_count;
+      size_t total_buddy_metadata = total_buddy_blocks * sizeof(MallocMetadata);
+      size_t arena_bytes = totals.arena_count * (ARENA_SIZE - MIN_BLOCK_SIZE_BYTES);
+      return arena_bytes - total_buddy_metadata + g_mmap_bytes.load(std::memory_order_relaxed);
+  }
+
+  static void _heap_stats(HeapStats* stats) {
+      HeapTotals totals;
+      sumHeaps(&totals);
+      size_t cached[TCACHE_MAX_ORDER + 1];
+      pthread_mutex_lock(&g_global_lock);
+      cachedCounts(cached);
+      stats->mmap_blocks = g_mmap_block_count;
+      stats->large_cache_bytes = g_large_cache_bytes;
+      pthread_mutex_unlock(&g_global_lock);
+      stats->free_bytes = freeListBytes(&totals);
+      //orders past MAX_ORDER do not exist in this geometry
+      std::memset(stats->free_blocks, 0, sizeof(stats->free_blocks));
+      std::memset(stats->cached_blocks, 0, sizeof(stats->cached_blocks));
+      for (int i = 0; i <= MAX_ORDER; ++i) {
+          stats->free_blocks[i] = totals.free_counts[i];
+          stats->cached_blocks[i] = i <= TCACHE_MAX_ORDER ? cached[i] : 0;
+          stats->free_bytes += stats->cached_blocks[i] * (blockSize(i) - sizeof(MallocMetadata));
+      }
+      stats->used_blocks = totals.used_block_count;
+      stats->arena_count = totals.arena_count;
+      stats->arena_bytes = totals.arena_count * ARENA_SIZE;
+      stats->slab_count = totals.slab_count;
+      stats->mmap_bytes = g_mmap_bytes.load(std::memory_order_relaxed);
+      stats->hugepage_bytes = g_hugepage_bytes.load(std::memory_order_relaxed);
+      stats->in_use_bytes = totals.in_use_bytes + stats->mmap_bytes;
+      stats->peak_in_use_bytes = std::max(g_peak_in_use_bytes.load(std::memory_order_relaxed), stats->in_use_bytes);
+      stats->purged_bytes = g_purged_bytes.load(std::memory_order_relaxed);
+      stats->resident_bytes = stats->arena_bytes - totals.zero_bytes + stats->mmap_bytes;
+      stats->fragmentation = 0;
+      if (totals.free_order_mask) {
+          size_t largest = blockSize(31 - __builtin_clz(totals.free_order_mask));
+          stats->fragmentation = 1.0 - (double)largest / totals.free_list_bytes;
+      }
+  }
+
+  //one header word per block, plus the Slab record (and its padding) of every
+  //slab and the reserved Arena block of every arena
+  static size_t _num_meta_data_bytes() {
+    HeapTotals totals;
+    sumHeaps(&totals);
+    return allocatedBlocks(&totals) * sizeof(MallocMetadata) +
+           totals.slab_count * (SLAB_OBJECTS_OFFSET - sizeof(MallocMetadata)) +
+           totals.arena_count * MIN_BLOCK_SIZE_BYTES;
+  }
+
+  static size_t _size_meta_data() {
+    return sizeof(MallocMetadata);
+  }
+
+  static void shugepages(bool enable, size_t large_min_bytes) {
+    g_hugepage_min_bytes.store(large_min_bytes, std::memory_order_relaxed);
+    g_hugepages.store(enable, std::memory_order_relaxed);
+  }
+
+  static size_t _num_hugepage_bytes() {
+    return g_hugepage_bytes.load(std::memory_order_relaxed);
+  }
+
+  //the purge thread wakes every quarter of the decay window, within bounds,
+  //and purges every heap in turn
+  static void* purgeThreadMain(void*) {
+    pthread_mutex_lock(&g_purge_lock);
+    while (!g_purge_thread_stop) {
+      pthread_mutex_unlock(&g_purge_lock);
+      uint64_t now = monotonicNs();
+      int limit = g_heap_limit.load(std::memory_order_relaxed);
+      for (int i = 0; i < limit; ++i) {
+        pthread_mutex_lock(&g_heaps[i].lock);
+        purgeDecayed(&g_heaps[i], now);
+        pthread_mutex_unlock(&g_heaps[i].lock);
+      }
+      long nap_ms = std::min(std::max(g_purge_decay_ms.load(std::memory_order_relaxed) / 4, 1L), 1000L);
+      struct timespec until;
+      clock_gettime(CLOCK_REALTIME, &until);
+      until.tv_nsec += nap_ms * 1000000;
+      until.tv_sec += until.tv_nsec / 1000000000;
+      until.tv_nsec %= 1000000000;
+      pthread_mutex_lock(&g_purge_lock);
+      if (!g_purge_thread_stop) pthread_cond_timedwait(&g_purge_wake, &g_purge_lock, &until);
+    }
+    pthread_mutex_unlock(&g_purge_lock);
+    return NULL;
+  }
+
+  static void spurge(long decay_ms, bool background) {
+    g_purge_decay_ms.store(decay_ms, std::memory_order_relaxed);
+    bool want_thread = background && decay_ms >= 0;
+    pthread_mutex_lock(&g_purge_config_lock);
+    if (want_thread && !g_purge_thread_running) {
+      g_purge_thread_stop = false;
+      g_purge_thread_running = pthread_create(&g_purge_thread, NULL, purgeThreadMain, NULL) == 0;
+    } else if (!want_thread && g_purge_thread_running) {
+      pthread_mutex_lock(&g_purge_lock);
+      g_purge_thread_stop = true;
+      pthread_cond_signal(&g_purge_wake);
+      pthread_mutex_unlock(&g_purge_lock);
+      pthread_join(g_purge_thread, NULL);
+      g_purge_thread_running = false;
+    }
+    pthread_mutex_unlock(&g_purge_config_lock);
+  }
+
+  static size_t _num_purged_bytes() {
+    return g_purged_bytes.load(std::memory_order_relaxed);
+  }
+
+  static size_t _num_resident_bytes() {
+    HeapStats stats;
+    _heap_stats(&stats);
+    return stats.resident_bytes;
+  }
+
+  static void sremote_frees(bool enable) {
+    g_remote_frees.store(enable, std::memory_order_relaxed);
+  }
+
+  static size_t _num_realloc_copies_avoided() {
+    return g_realloc_copies_avoided.load(std::memory_order_relaxed);
+  }
+};
+
+template <typename Geometry> typename BuddyEngine<Geometry>::Heap BuddyEngine<Geometry>::g_heaps[MAX_HEAPS];
+template <typename Geometry> std::atomic<int> BuddyEngine<Geometry>::g_heap_limit(0);
+template <typename Geometry> std::atomic<bool> BuddyEngine<Geometry>::g_sbrk_claimed(false);
+template <typename Geometry> std::atomic<typename BuddyEngine<Geometry>::MapMid*> BuddyEngine<Geometry>::g_map_root[1 << MAP_ROOT_BITS];
+template <typename Geometry> pthread_mutex_t BuddyEngine<Geometry>::g_global_lock = PTHREAD_MUTEX_INITIALIZER;
+template <typename Geometry> size_t BuddyEngine<Geometry>::g_mmap_block_count = 0;
+template <typename Geometry> CachedMapping* BuddyEngine<Geometry>::g_large_cache[LARGE_CACHE_BUCKETS] = {nullptr};
+template <typename Geometry> CachedMapping* BuddyEngine<Geometry>::g_large_cache_oldest = nullptr;
+template <typename Geometry> CachedMapping* BuddyEngine<Geometry>::g_large_cache_newest = nullptr;
+template <typename Geometry> size_t BuddyEngine<Geometry>::g_large_cache_bytes = 0;
+template <typename Geometry> typename BuddyEngine<Geometry>::TCache* BuddyEngine<Geometry>::g_tcache_list = nullptr;
+template <typename Geometry> std::atomic<size_t> BuddyEngine<Geometry>::g_mmap_bytes(0);
+template <typename Geometry> std::atomic<size_t> BuddyEngine<Geometry>::g_peak_in_use_bytes(0);
+template <typename Geometry> std::atomic<size_t> BuddyEngine<Geometry>::g_realloc_copies_avoided(0);
+template <typename Geometry> std::atomic<bool> BuddyEngine<Geometry>::g_hugepages(false);
+template <typename Geometry> std::atomic<size_t> BuddyEngine<Geometry>::g_hugepage_min_bytes(0);
+template <typename Geometry> std::atomic<size_t> BuddyEngine<Geometry>::g_hugepage_bytes(0);
+template <typename Geometry> std::atomic<bool> BuddyEngine<Geometry>::g_remote_frees(false);
+template <typename Geometry> std::atomic<long> BuddyEngine<Geometry>::g_purge_decay_ms(DEFAULT_PURGE_DECAY_MS);
+template <typename Geometry> std::atomic<size_t> BuddyEngine<Geometry>::g_purged_bytes(0);
+template <typename Geometry> pthread_mutex_t BuddyEngine<Geometry>::g_purge_config_lock = PTHREAD_MUTEX_INITIALIZER;
+template <typename Geometry> pthread_mutex_t BuddyEngine<Geometry>::g_purge_lock = PTHREAD_MUTEX_INITIALIZER;
+template <typename Geometry> pthread_cond_t BuddyEngine<Geometry>::g_purge_wake = PTHREAD_COND_INITIALIZER;
+template <typename Geometry> bool BuddyEngine<Geometry>::g_purge_thread_running = false;
+template <typename Geometry> bool BuddyEngine<Geometry>::g_purge_thread_stop = false;
+template <typename Geometry> pthread_t BuddyEngine<Geometry>::g_purge_thread;
+template <typename Geometry> pthread_key_t BuddyEngine<Geometry>::g_tcache_key;
+template <typename Geometry> pthread_once_t BuddyEngine<Geometry>::g_process_hooks_once = PTHREAD_ONCE_INIT;
+template <typename Geometry> thread_local typename BuddyEngine<Geometry>::TCache BuddyEngine<Geometry>::t_cache;
+
+template <typename Geometry>
+void* BuddyAllocator<Geometry>::smalloc(size_t size) {
+  return BuddyEngine<Geometry>::smalloc(size);
+}
+
+template <typename Geometry>
+void* BuddyAllocator<Geometry>::scalloc(size_t num, size_t size) {
+  return BuddyEngine<Geometry>::scalloc(num, size);
+}
+
+template <typename Geometry>
+void BuddyAllocator<Geometry>::sfree(void* p) {
+  BuddyEngine<Geometry>::sfree(p);
+}
+
+template <typename Geometry>
+void* BuddyAllocator<Geometry>::srealloc(void* oldp, size_t size) {
+  return BuddyEngine<Geometry>::srealloc(oldp, size);
+}
+
+template <typename Geometry>
+void BuddyAllocator<Geometry>::sfree_sized(void* p, size_t size) {
+  BuddyEngine<Geometry>::sfree_sized(p, size);
+}
+
+template <typename Geometry>
+size_t BuddyAllocator<Geometry>::usable_size(void* p) {
+  return BuddyEngine<Geometry>::smalloc_usable_size(p);
+}
+
+template <typename Geometry>
+void* BuddyAllocator<Geometry>::smemalign(size_t alignment, size_t size) {
+  return BuddyEngine<Geometry>::smemalign(alignment, size);
+}
+
+template <typename Geometry>
+void BuddyAllocator<Geometry>::heap_stats(HeapStats* stats) {
+  BuddyEngine<Geometry>::_heap_stats(stats);
+}
+
+template struct BuddyAllocator<SmallObjectGeometry>;
+template struct BuddyAllocator<BalancedGeometry>;
+template struct BuddyAllocator<LargeBufferGeometry>;
+
+typedef BuddyEngine<MALLOC3_GEOMETRY> DefaultEngine;
+
+//the LD_PRELOAD shim calls these two directly
+void* reallocAligned(void* p, size_t size, size_t alignment) {
+  return DefaultEngine::reallocAligned(p, size, alignment);
+}
+
+size_t usableSize(void* p) {
+  return DefaultEngine::usableSize(p);
+}
+
+//the public API is the default engine's
+
+void* smalloc(size_t size) {
+  return DefaultEngine::smalloc(size);
+}
+
+void* scalloc(size_t num, size_t size) {
+  return DefaultEngine::scalloc(num, size);
+}
+
+void sfree(void* p) {
+  DefaultEngine::sfree(p);
+}
+
+void* srealloc(void* oldp, size_t size) {
+  return DefaultEngine::srealloc(oldp, size);
+}
+
+void sfree_sized(void* p, size_t size) {
+  DefaultEngine::sfree_sized(p, size);
+}
+
+size_t smalloc_usable_size(void* p) {
+  return DefaultEngine::smalloc_usable_size(p);
+}
+
+void* smemalign(size_t alignment, size_t size) {
+  return DefaultEngine::smemalign(alignment, size);
+}
+
+void* saligned_alloc(size_t alignment, size_t size) {
+  return DefaultEngine::saligned_alloc(alignment, size);
+}
+
+size_t smalloc_batch(size_t size, size_t count, void** out_ptrs) {
+  return DefaultEngine::smalloc_batch(size, count, out_ptrs);
+}
+
+void sfree_batch(void** ptrs, size_t count) {
+  DefaultEngine::sfree_batch(ptrs, count);
+}
+
+void shugepages(bool enable, size_t large_min_bytes) {
+  DefaultEngine::shugepages(enable, large_min_bytes);
+}
+
+void sremote_frees(bool enable) {
+  DefaultEngine::sremote_frees(enable);
+}
+
+void spurge(long decay_ms, bool background) {
+  DefaultEngine::spurge(decay_ms, background);
+}
+
+size_t _num_free_blocks() {
+  return DefaultEngine::_num_free_blocks();
+}
+
+size_t _num_free_bytes() {
+  return DefaultEngine::_num_free_bytes();
+}
+
+size_t _num_allocated_blocks() {
+  return DefaultEngine::_num_allocated_blocks();
+}
+
+size_t _num_allocated_bytes() {
+  return DefaultEngine::_num_allocated_bytes();
+}
+
+size_t _num_meta_data_bytes() {
+  return DefaultEngine::_num_meta_data_bytes();
+}
+
+size_t _size_meta_data() {
+  return DefaultEngine::_size_meta_data();
+}
+
+void _heap_stats(HeapStats* stats) {
+  DefaultEngine::_heap_stats(stats);
+}
+
+size_t _num_realloc_copies_avoided() {
+  return DefaultEngine::_num_realloc_copies_avoided();
+}
+
+size_t _num_hugepage_bytes() {
+  return DefaultEngine::_num_hugepage_bytes();
+}
+
+size_t _num_purged_bytes() {
+  return DefaultEngine::_num_purged_bytes();
+}
+
+size_t _num_resident_bytes() {
+  return DefaultEngine::_num_resident_bytes();
+}
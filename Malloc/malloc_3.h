@@ -0,0 +1,142 @@
+#ifndef MALLOC_3_H
+#define MALLOC_3_H
+
+#include <cstddef>
+
+// Allocation API. All functions are thread-safe.
+void* smalloc(size_t size);
+void* scalloc(size_t num, size_t size);
+void sfree(void* p);
+void* srealloc(void* oldp, size_t size);
+
+// Sized free: size may be anything from the size a block was last asked for
+// (from smalloc, scalloc, srealloc or smalloc_batch) up to its usable size.
+// Small blocks go to the thread cache without their header being read.
+// Blocks from smemalign and saligned_alloc must go to sfree.
+void sfree_sized(void* p, size_t size);
+
+// Bytes usable at p, at least the size asked for; 0 for NULL.
+size_t smalloc_usable_size(void* p);
+
+// Aligned allocation; alignment must be a power of two, and for
+// saligned_alloc size must be a multiple of it. Blocks of any alignment are
+// released with sfree. srealloc keeps the alignment only when it resizes in place.
+void* smemalign(size_t alignment, size_t size);
+void* saligned_alloc(size_t alignment, size_t size);
+
+// Batch allocation of count blocks of the same size. Returns how many were
+// allocated into out_ptrs, fewer than count only when memory runs out.
+// Buddy-sized blocks are carved from one larger block where possible.
+// sfree_batch takes blocks of any sizes. Pieces from one smalloc_batch call
+// merge fastest when they are passed back in the order they were returned.
+size_t smalloc_batch(size_t size, size_t count, void** out_ptrs);
+void sfree_batch(void** ptrs, size_t count);
+
+// Transparent huge page mode, off by default. While enabled, new arenas are
+// marked MADV_HUGEPAGE, and mmap'd blocks of at least large_min_bytes start on
+// a 2 MB boundary and are marked as well. Arenas created earlier keep 4 KB pages.
+void shugepages(bool enable, size_t large_min_bytes);
+
+// Remote free queues, off by default. While enabled, a block freed on a CPU
+// other than the one whose heap it came from is pushed onto a lock-free
+// stack of that heap instead of taking its lock. The heap takes the whole
+// stack back the next time it allocates.
+void sremote_frees(bool enable);
+
+// Purging of free memory, on with a 10 s decay by default. A free 128 KB
+// block whose pages have gone unused for decay_ms is given back to the kernel
+// with madvise(MADV_DONTNEED). Purging happens inline when its heap frees or
+// refills, and also on a background thread if background is set. A negative
+// decay_ms turns purging off; 0 purges a block as soon as it is free.
+void spurge(long decay_ms, bool background);
+
+// Heap statistics. Blocks sitting in a thread cache are reported as free.
+size_t _num_free_blocks();
+size_t _num_free_bytes();
+size_t _num_allocated_blocks();
+size_t _num_allocated_bytes();
+size_t _num_meta_data_bytes();
+size_t _size_meta_data();
+
+// Point-in-time view of the heap. Filled in O(MAX_ORDER) plus one pass over
+// the live threads' caches, independent of how many blocks the heap holds.
+// Orders past the geometry's MAX_ORDER are reported as 0.
+const int HEAP_STATS_ORDERS = 16;
+
+struct HeapStats {
+    size_t free_blocks[HEAP_STATS_ORDERS];   // on the central free lists, per order
+    size_t cached_blocks[HEAP_STATS_ORDERS]; // in thread caches, per order
+    size_t free_bytes;                       // payload bytes of free and cached blocks
+    size_t used_blocks;                      // allocated buddy blocks, slabs and cached blocks included
+    size_t arena_count;
+    size_t arena_bytes;
+    size_t slab_count;
+    size_t mmap_blocks;
+    size_t mmap_bytes;                       // payload bytes of live mmap'd blocks
+    size_t large_cache_bytes;                // freed mappings kept for reuse
+    size_t hugepage_bytes;
+    size_t in_use_bytes;                     // arena bytes off the free lists plus mmap bytes
+    size_t peak_in_use_bytes;
+    double fragmentation;                    // 1 - largest free block / free list bytes
+    size_t purged_bytes;                     // arena bytes given back with madvise, in total
+    size_t resident_bytes;                   // estimate: arena bytes neither purged nor never touched, plus mmap bytes
+};
+
+void _heap_stats(HeapStats* stats);
+
+// Number of srealloc calls that grew a block in place instead of copying it.
+size_t _num_realloc_copies_avoided();
+
+// Bytes of arenas and live mmap'd blocks marked MADV_HUGEPAGE.
+size_t _num_hugepage_bytes();
+
+// Total arena bytes purged so far, and HeapStats::resident_bytes.
+size_t _num_purged_bytes();
+size_t _num_resident_bytes();
+
+// Buddy geometry. A block of order k is MIN_BLOCK_SIZE_BYTES << k bytes, up to
+// MAX_ORDER; an arena holds INITIAL_ARENA_BLOCKS blocks of MAX_ORDER, and
+// requests of MMAP_THRESHOLD bytes and up, header included, are mmap'd. All
+// sizes are powers of two, MIN_BLOCK_SIZE_BYTES between 32 and 512, and the
+// threshold at most the largest block. The functions above use
+// BalancedGeometry unless malloc_3.cpp is built with
+// -DMALLOC3_GEOMETRY=<preset>.
+struct SmallObjectGeometry {  // 64 B to 32 KB blocks in 2 MB arenas
+    static const size_t MIN_BLOCK_SIZE_BYTES = 64;
+    static const int MAX_ORDER = 9;
+    static const size_t INITIAL_ARENA_BLOCKS = 64;
+    static const size_t MMAP_THRESHOLD = 32 * 1024;
+};
+
+struct BalancedGeometry {     // 128 B to 128 KB blocks in 4 MB arenas
+    static const size_t MIN_BLOCK_SIZE_BYTES = 128;
+    static const int MAX_ORDER = 10;
+    static const size_t INITIAL_ARENA_BLOCKS = 32;
+    static const size_t MMAP_THRESHOLD = 128 * 1024;
+};
+
+struct LargeBufferGeometry {  // 256 B to 1 MB blocks in 16 MB arenas
+    static const size_t MIN_BLOCK_SIZE_BYTES = 256;
+    static const int MAX_ORDER = 12;
+    static const size_t INITIAL_ARENA_BLOCKS = 16;
+    static const size_t MMAP_THRESHOLD = 1024 * 1024;
+};
+
+// A buddy allocator of its own for each geometry, so differently tuned heaps
+// can live in one process. Each one has separate heaps, thread caches and
+// statistics, with default settings; BuddyAllocator<G>::sfree ignores blocks
+// that did not come from BuddyAllocator<G>. The one of the default geometry
+// is the allocator behind smalloc. Instantiated for the three presets above.
+template <typename Geometry>
+struct BuddyAllocator {
+    static void* smalloc(size_t size);
+    static void* scalloc(size_t num, size_t size);
+    static void sfree(void* p);
+    static void* srealloc(void* oldp, size_t size);
+    static void sfree_sized(void* p, size_t size);
+    static size_t usable_size(void* p);
+    static void* smemalign(size_t alignment, size_t size);
+    static void heap_stats(HeapStats* stats);
+};
+
+#endif // MALLOC_3_H
@@ -0,0 +1,113 @@
+// LD_PRELOAD shim: exports the libc allocation functions on top of malloc_3,
+// so unmodified programs can run on it.
+//
+// To use:
+//  make libmalloc3.so
+//  LD_PRELOAD=./libmalloc3.so <program>
+//
+// malloc_3 itself only guarantees 8-byte alignment; every function here hands
+// out at least MALLOC_ALIGNMENT, which is what libc promises. Requests larger
+// than malloc_3's MAX_ALLOC fail with ENOMEM.
+
+#include <cerrno>
+#include <cstring>
+#include <cstdint>
+#include <unistd.h>
+#include "malloc_3.h"
+
+#define SHIM_EXPORT extern "C" __attribute__((visibility("default")))
+
+// Defined in malloc_3.cpp.
+void* reallocAligned(void* p, size_t size, size_t alignment);
+size_t usableSize(void* p);
+
+const size_t MALLOC_ALIGNMENT = 16;
+
+static bool isPowerOfTwo(size_t x) {
+    return x && !(x & (x - 1));
+}
+
+static void* allocate(size_t alignment, size_t size) {
+    if (alignment < MALLOC_ALIGNMENT) alignment = MALLOC_ALIGNMENT;
+    void* p = smemalign(alignment, size ? size : 1);
+    if (!p) errno = ENOMEM;
+    return p;
+}
+
+SHIM_EXPORT void* malloc(size_t size) {
+    return allocate(MALLOC_ALIGNMENT, size);
+}
+
+SHIM_EXPORT void free(void* p) {
+    sfree(p);
+}
+
+SHIM_EXPORT void* calloc(size_t num, size_t size) {
+    size_t total;
+    if (__builtin_mul_overflow(num, size, &total)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    void* p = allocate(MALLOC_ALIGNMENT, total);
+    if (p) std::memset(p, 0, total);
+    return p;
+}
+
+SHIM_EXPORT void* realloc(void* p, size_t size) {
+    if (p && size == 0) {
+        sfree(p);
+        return NULL;
+    }
+    void* new_p = reallocAligned(p, size ? size : 1, MALLOC_ALIGNMENT);
+    if (!new_p) errno = ENOMEM;
+    return new_p;
+}
+
+SHIM_EXPORT void* reallocarray(void* p, size_t num, size_t size) {
+    size_t total;
+    if (__builtin_mul_overflow(num, size, &total)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return realloc(p, total);
+}
+
+SHIM_EXPORT int posix_memalign(void** result, size_t alignment, size_t size) {
+    if (!isPowerOfTwo(alignment) || alignment % sizeof(void*)) return EINVAL;
+    void* p = smemalign(alignment < MALLOC_ALIGNMENT ? MALLOC_ALIGNMENT : alignment, size ? size : 1);
+    if (!p) return ENOMEM;
+    *result = p;
+    return 0;
+}
+
+SHIM_EXPORT void* aligned_alloc(size_t alignment, size_t size) {
+    if (!isPowerOfTwo(alignment)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return allocate(alignment, size);
+}
+
+SHIM_EXPORT void* memalign(size_t alignment, size_t size) {
+    //like glibc, round a bad alignment up instead of failing
+    size_t rounded = MALLOC_ALIGNMENT;
+    while (rounded < alignment) rounded <<= 1;
+    return allocate(rounded, size);
+}
+
+SHIM_EXPORT void* valloc(size_t size) {
+    return allocate(sysconf(_SC_PAGESIZE), size);
+}
+
+SHIM_EXPORT void* pvalloc(size_t size) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    if (size > SIZE_MAX - page) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return allocate(page, (size + page - 1) & ~(page - 1));
+}
+
+SHIM_EXPORT size_t malloc_usable_size(void* p) {
+    return p ? usableSize(p) : 0;
+}